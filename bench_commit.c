@@ -0,0 +1,156 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <drm_fourcc.h>
+
+#include "dp_drm.h"
+#include "util.h"
+
+// Compares TEST_ONLY commits built with drmModeAtomicAddProperty against
+// commit plans, for the first connected connector. The ioctl dominates the
+// commit time, so building the request is also timed on its own.
+
+static const int iterations = 10000;
+
+// Emits everything, like the commit plan does
+static void libdrm_build(struct crtc *crtc) {
+	struct device *dev = crtc->dev;
+
+	crtc_update(crtc, dev->atomic_req, true);
+	for (size_t i = 0; i < dev->connectors_len; ++i) {
+		struct connector *conn = &dev->connectors[i];
+		if (conn->crtc == crtc) {
+			connector_update(conn, dev->atomic_req, true);
+		}
+	}
+	for (size_t i = 0; i < dev->planes_len; ++i) {
+		struct plane *plane = &dev->planes[i];
+		if (plane->crtc == crtc) {
+			plane_update(plane, dev->atomic_req, true);
+		}
+	}
+}
+
+static void libdrm_commit(struct crtc *crtc, uint32_t flags) {
+	struct device *dev = crtc->dev;
+	int cursor = drmModeAtomicGetCursor(dev->atomic_req);
+
+	libdrm_build(crtc);
+
+	int ret = drmModeAtomicCommit(dev->fd, dev->atomic_req, flags, dev);
+	if (ret != 0) {
+		ret = -errno;
+	}
+	device_handle_commit(dev, flags, ret);
+	if (ret != 0) {
+		errno = -ret;
+		fatal_errno("drmModeAtomicCommit failed");
+	}
+
+	drmModeAtomicSetCursor(dev->atomic_req, cursor);
+}
+
+int main(int argc, char *argv[]) {
+	const char *device_path = "/dev/dri/card0";
+	if (argc == 2) {
+		device_path = argv[1];
+	}
+
+	struct device dev = { 0 };
+	device_init(&dev, device_path, 0);
+
+	struct connector *conn = NULL;
+	for (size_t i = 0; i < dev.connectors_len; ++i) {
+		if (dev.connectors[i].state == DRM_MODE_CONNECTED && conn == NULL) {
+			conn = &dev.connectors[i];
+		} else {
+			connector_set_crtc(&dev.connectors[i], NULL);
+		}
+	}
+	if (conn == NULL || conn->modes_len == 0) {
+		fatal("failed to find a connected connector");
+	}
+
+	struct crtc *crtc = NULL;
+	for (size_t i = 0; i < dev.crtcs_len; ++i) {
+		if (conn->possible_crtcs & (1 << i)) {
+			crtc = &dev.crtcs[i];
+			break;
+		}
+	}
+	if (crtc == NULL || !connector_set_crtc(conn, crtc)) {
+		fatal("failed to find a CRTC");
+	}
+	crtc_set_mode(crtc, &conn->modes[0]);
+	crtc->active = true;
+
+	struct plane *primary = NULL;
+	for (size_t i = 0; i < dev.planes_len; ++i) {
+		struct plane *plane = &dev.planes[i];
+		if (plane->type == DRM_PLANE_TYPE_PRIMARY && primary == NULL &&
+				plane_set_crtc(plane, crtc)) {
+			primary = plane;
+		} else if (plane->crtc == crtc) {
+			plane_set_crtc(plane, NULL);
+		}
+	}
+	if (primary == NULL) {
+		fatal("failed to find a primary plane");
+	}
+
+	struct framebuffer_dumb fb = { 0 };
+	framebuffer_dumb_init(&fb, &dev, DRM_FORMAT_XRGB8888,
+		crtc->mode->hdisplay, crtc->mode->vdisplay);
+	primary->width = fb.fb.width;
+	primary->height = fb.fb.height;
+	plane_set_framebuffer(primary, &fb.fb);
+
+	device_commit(&dev, DRM_MODE_ATOMIC_ALLOW_MODESET);
+
+	struct commit_plan plan;
+	commit_plan_init(&plan, crtc);
+
+	int cursor = drmModeAtomicGetCursor(dev.atomic_req);
+	uint64_t start = now_ns();
+	for (int i = 0; i < iterations; ++i) {
+		libdrm_build(crtc);
+		drmModeAtomicSetCursor(dev.atomic_req, cursor);
+	}
+	uint64_t libdrm_build_ns = now_ns() - start;
+
+	start = now_ns();
+	for (int i = 0; i < iterations; ++i) {
+		libdrm_commit(crtc, DRM_MODE_ATOMIC_TEST_ONLY);
+	}
+	uint64_t libdrm_ns = now_ns() - start;
+
+	start = now_ns();
+	for (int i = 0; i < iterations; ++i) {
+		commit_plan_prepare(&plan);
+	}
+	uint64_t plan_build_ns = now_ns() - start;
+
+	start = now_ns();
+	for (int i = 0; i < iterations; ++i) {
+		int ret = commit_plan_commit(&plan, DRM_MODE_ATOMIC_TEST_ONLY);
+		if (ret != 0) {
+			errno = -ret;
+			fatal_errno("DRM_IOCTL_MODE_ATOMIC failed");
+		}
+	}
+	uint64_t plan_ns = now_ns() - start;
+
+	printf("drmModeAtomicAddProperty: %"PRIu64" ns/build, "
+		"%"PRIu64" ns/commit\n", libdrm_build_ns / iterations,
+		libdrm_ns / iterations);
+	printf("commit plan: %"PRIu64" ns/build, %"PRIu64" ns/commit\n",
+		plan_build_ns / iterations, plan_ns / iterations);
+
+	commit_plan_finish(&plan);
+	// The framebuffer may be on screen
+	device_restore(&dev);
+	framebuffer_dumb_finish(&fb);
+	device_finish(&dev);
+	return EXIT_SUCCESS;
+}
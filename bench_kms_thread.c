@@ -0,0 +1,169 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include <drm_fourcc.h>
+#include <xf86drm.h>
+
+#include "dp.h"
+#include "kms_thread.h"
+#include "pixel.h"
+#include "util.h"
+
+// Renders a moving bar on the primary plane of every output, and hands the
+// frames over to the KMS thread. Prints where frame time goes.
+
+static const int frames_per_output = 300;
+static const size_t swapchain_len = 3;
+static const uint32_t bar_width = 64;
+
+struct output {
+	struct crtc *crtc;
+	struct plane *primary;
+	struct swapchain swapchain;
+	int frames;
+};
+
+static struct output *outputs = NULL;
+static size_t outputs_len = 0;
+static size_t outputs_done = 0;
+static struct kms_thread kms_thread = { 0 };
+
+static void render(struct output *out) {
+	struct kms_frame frame = {
+		.crtc = out->crtc,
+		.user_data = out,
+		.render_start_ns = now_ns(),
+	};
+
+	struct framebuffer_dumb *fb = swapchain_acquire(&out->swapchain);
+	if (fb == NULL) {
+		fatal("no free buffer for CRTC %"PRIu32, out->crtc->id);
+	}
+
+	void *data = NULL;
+	framebuffer_dumb_map(fb, PROT_WRITE, &data);
+	pixel_fill(data, fb->stride, fb->fb.width, fb->fb.height, 0xFF000040);
+	uint32_t x = (out->frames * 8) % (fb->fb.width - bar_width);
+	pixel_fill((uint8_t *)data + x * 4, fb->stride, bar_width,
+		fb->fb.height, 0xFFFFFFFF);
+	framebuffer_dumb_unmap(fb, data);
+
+	swapchain_queue(&out->swapchain, fb);
+
+	frame.planes_len = 1;
+	frame.planes[0] = (struct kms_plane_state){
+		.plane = out->primary,
+		.fb = &fb->fb,
+		.width = fb->fb.width,
+		.height = fb->fb.height,
+		.alpha = 1,
+	};
+	if (!kms_thread_submit(&kms_thread, &frame)) {
+		fatal("KMS thread frame ring is full");
+	}
+	// The buffer now belongs to the KMS thread
+	swapchain_handle_commit(&out->swapchain);
+}
+
+static void handle_frame(const struct kms_frame *frame, int status,
+		void *data) {
+	struct output *out = frame->user_data;
+	if (status == -ECANCELED) {
+		// The newer frame completes the output
+		swapchain_handle_cancel(&out->swapchain,
+			(struct framebuffer_dumb *)frame->planes[0].fb);
+		return;
+	} else if (status != 0) {
+		fatal("commit failed for CRTC %"PRIu32": %d", out->crtc->id, status);
+	}
+
+	swapchain_handle_page_flip(&out->swapchain);
+
+	++out->frames;
+	if (out->frames == frames_per_output) {
+		++outputs_done;
+	}
+	if (out->frames < frames_per_output) {
+		render(out);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	const char *device_path = "/dev/dri/card0";
+	if (argc == 2) {
+		device_path = argv[1];
+	}
+
+	struct device dev = { 0 };
+	device_init(&dev, device_path, DEVICE_INIT_FAST_PROBE);
+
+	if (device_enable_outputs(&dev) == 0) {
+		fatal("failed to enable any connected connector");
+	}
+	device_commit(&dev, DRM_MODE_ATOMIC_ALLOW_MODESET);
+
+	outputs = xalloc(dev.crtcs_len * sizeof(struct output));
+	for (size_t i = 0; i < dev.crtcs_len; ++i) {
+		struct crtc *crtc = &dev.crtcs[i];
+		if (!crtc->active) {
+			continue;
+		}
+
+		struct plane *primary = NULL;
+		for (size_t j = 0; j < dev.planes_len; ++j) {
+			struct plane *plane = &dev.planes[j];
+			if (plane->type == DRM_PLANE_TYPE_PRIMARY &&
+					(plane->crtc == NULL || plane->crtc == crtc) &&
+					plane_set_crtc(plane, crtc)) {
+				primary = plane;
+				break;
+			}
+		}
+		if (primary == NULL) {
+			fatal("no primary plane for CRTC %"PRIu32, crtc->id);
+		}
+
+		struct output *out = &outputs[outputs_len++];
+		out->crtc = crtc;
+		out->primary = primary;
+		swapchain_init(&out->swapchain, &dev, NULL, DRM_FORMAT_XRGB8888,
+			crtc->mode->hdisplay, crtc->mode->vdisplay, swapchain_len);
+	}
+
+	struct event_loop loop;
+	event_loop_init(&loop);
+	kms_thread_init(&kms_thread, &dev, &loop, handle_frame, NULL);
+
+	for (size_t i = 0; i < outputs_len; ++i) {
+		render(&outputs[i]);
+	}
+
+	while (outputs_done < outputs_len) {
+		int ret = event_loop_dispatch(&loop, -1);
+		if (ret < 0) {
+			errno = -ret;
+			fatal_errno("event_loop_dispatch failed");
+		}
+	}
+
+	kms_thread_finish(&kms_thread);
+	kms_thread_print_stats(&kms_thread);
+	event_loop_finish(&loop);
+
+	// The swapchains are still being scanned out
+	device_restore(&dev);
+
+	for (size_t i = 0; i < outputs_len; ++i) {
+		struct output *out = &outputs[i];
+		frame_stats_print(&out->crtc->stats, out->crtc->id);
+		plane_set_framebuffer(out->primary, NULL);
+		swapchain_finish(&out->swapchain);
+	}
+	free(outputs);
+
+	device_finish(&dev);
+	return EXIT_SUCCESS;
+}
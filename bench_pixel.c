@@ -0,0 +1,144 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pixel.h"
+#include "util.h"
+
+// Reports the throughput of each pixel kernel implementation on a full-HD
+// buffer, after checking that they all match the scalar implementation
+
+static const uint32_t width = 1920, height = 1080;
+static const int iterations = 100;
+
+static uint32_t *alloc_buffer(uint32_t stride, uint32_t h) {
+	uint32_t *buf = aligned_alloc(64, (size_t)stride * h);
+	if (buf == NULL) {
+		fatal("aligned_alloc failed");
+	}
+	return buf;
+}
+
+static void fill_random(uint32_t *buf, size_t len) {
+	for (size_t i = 0; i < len; ++i) {
+		// Keep the pixels premultiplied
+		uint32_t a = rand() & 0xFF;
+		uint32_t px = a << 24;
+		for (int shift = 0; shift < 24; shift += 8) {
+			px |= (uint32_t)(rand() % (a + 1)) << shift;
+		}
+		buf[i] = px;
+	}
+}
+
+// Odd sizes and offsets exercise the tails of the vectorized loops
+static void check_impl(const struct pixel_impl *impl) {
+	const struct pixel_impl *ref;
+	pixel_get_impls(&ref, 1); // scalar comes first
+	const uint32_t w = 67, h = 13, stride = 80 * 4;
+	size_t len = stride / 4 * h;
+
+	uint32_t *src = alloc_buffer(stride, h);
+	uint32_t *expected = alloc_buffer(stride, h);
+	uint32_t *got = alloc_buffer(stride, h);
+	fill_random(src, len);
+	fill_random(expected, len);
+	memcpy(got, expected, len * 4);
+
+	ref->fill(expected + 1, stride, w, h - 1, 0x80402010);
+	impl->fill(got + 1, stride, w, h - 1, 0x80402010);
+	if (memcmp(expected, got, len * 4) != 0) {
+		fatal("%s fill doesn't match scalar", impl->name);
+	}
+
+	ref->copy(expected + 3, stride, src + 1, stride, w, h);
+	impl->copy(got + 3, stride, src + 1, stride, w, h);
+	if (memcmp(expected, got, len * 4) != 0) {
+		fatal("%s copy doesn't match scalar", impl->name);
+	}
+
+	ref->copy(expected + 6, stride, src, stride, w, h);
+	impl->copy_stream(got + 6, stride, src, stride, w, h);
+	if (memcmp(expected, got, len * 4) != 0) {
+		fatal("%s copy_stream doesn't match copy", impl->name);
+	}
+
+	fill_random(expected, len);
+	memcpy(got, expected, len * 4);
+	const uint8_t alphas[] = { 0xFF, 0x80, 0x00 };
+	for (size_t i = 0; i < sizeof(alphas); ++i) {
+		ref->blend(expected + 2, stride, src + 5, stride, w, h, alphas[i]);
+		impl->blend(got + 2, stride, src + 5, stride, w, h, alphas[i]);
+		if (memcmp(expected, got, len * 4) != 0) {
+			fatal("%s blend doesn't match scalar", impl->name);
+		}
+	}
+	for (size_t i = 0; i < sizeof(alphas); ++i) {
+		ref->blend_opaque(expected + 1, stride, src + 3, stride, w, h, alphas[i]);
+		impl->blend_opaque(got + 1, stride, src + 3, stride, w, h, alphas[i]);
+		if (memcmp(expected, got, len * 4) != 0) {
+			fatal("%s blend_opaque doesn't match scalar", impl->name);
+		}
+	}
+
+	free(src);
+	free(expected);
+	free(got);
+}
+
+static void report(const char *impl, const char *kernel, uint64_t ns,
+		size_t bytes_per_iter) {
+	double gbps = (double)bytes_per_iter * iterations / ns;
+	printf("%-8s %-6s %8.2f GB/s\n", impl, kernel, gbps);
+}
+
+int main(int argc, char *argv[]) {
+	const struct pixel_impl *impls[8];
+	size_t impls_len = pixel_get_impls(impls, 8);
+
+	for (size_t i = 0; i < impls_len; ++i) {
+		check_impl(impls[i]);
+	}
+
+	uint32_t stride = width * 4;
+	size_t size = (size_t)stride * height;
+	uint32_t *src = alloc_buffer(stride, height);
+	uint32_t *dst = alloc_buffer(stride, height);
+	fill_random(src, size / 4);
+	fill_random(dst, size / 4);
+
+	for (size_t i = 0; i < impls_len; ++i) {
+		const struct pixel_impl *impl = impls[i];
+
+		uint64_t start = now_ns();
+		for (int j = 0; j < iterations; ++j) {
+			impl->fill(dst, stride, width, height, 0xFF000000 | j);
+		}
+		report(impl->name, "fill", now_ns() - start, size);
+
+		start = now_ns();
+		for (int j = 0; j < iterations; ++j) {
+			impl->copy(dst, stride, src, stride, width, height);
+		}
+		report(impl->name, "copy", now_ns() - start, 2 * size);
+
+		start = now_ns();
+		for (int j = 0; j < iterations; ++j) {
+			impl->copy_stream(dst, stride, src, stride, width, height);
+		}
+		report(impl->name, "stream", now_ns() - start, 2 * size);
+
+		start = now_ns();
+		for (int j = 0; j < iterations; ++j) {
+			impl->blend(dst, stride, src, stride, width, height, 0xC0);
+		}
+		report(impl->name, "blend", now_ns() - start, 3 * size);
+	}
+
+	printf("selected implementation: %s\n", pixel_get_impl()->name);
+
+	free(src);
+	free(dst);
+	return EXIT_SUCCESS;
+}
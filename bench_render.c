@@ -0,0 +1,86 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pixel.h"
+#include "thread_pool.h"
+#include "util.h"
+
+// Reports how tiled rendering on the thread pool scales from 1 to N threads,
+// blending several layers into a 4K buffer
+
+static const uint32_t width = 3840, height = 2160;
+static const size_t layers_len = 4;
+static const int iterations = 50;
+static const uint32_t min_tile_rows = 16;
+
+struct render {
+	uint8_t *dst;
+	const uint8_t *src;
+	uint32_t stride;
+};
+
+static void render_tile(void *data, const struct rect *tile) {
+	const struct render *render = data;
+	size_t offset = (size_t)render->stride * tile->y + tile->x * 4;
+	uint8_t *dst = render->dst + offset;
+
+	pixel_fill(dst, render->stride, tile->width, tile->height, 0xFF000000);
+	for (size_t i = 0; i < layers_len; ++i) {
+		pixel_blend(dst, render->stride, render->src + offset, render->stride,
+			tile->width, tile->height, 0xC0);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t max_threads = cpus > 0 ? (size_t)cpus : 1;
+	if (argc == 2) {
+		max_threads = strtoul(argv[1], NULL, 10);
+	}
+
+	uint32_t stride = width * 4;
+	size_t size = (size_t)stride * height;
+	uint8_t *src = aligned_alloc(64, size);
+	uint8_t *dst = aligned_alloc(64, size);
+	if (src == NULL || dst == NULL) {
+		fatal("aligned_alloc failed");
+	}
+	memset(src, 0x80, size);
+	memset(dst, 0, size);
+
+	struct render render = { .dst = dst, .src = src, .stride = stride };
+	struct rect rect = { 0, 0, width, height };
+	uint32_t tile_rows = thread_pool_tile_rows(stride, min_tile_rows);
+
+	double base_ms = 0;
+	for (size_t threads = 1; threads <= max_threads; ++threads) {
+		struct thread_pool pool;
+		thread_pool_init(&pool, threads);
+
+		uint64_t start = now_ns();
+		for (int i = 0; i < iterations; ++i) {
+			struct thread_pool_job job = {
+				.func = render_tile,
+				.data = &render,
+			};
+			thread_pool_submit(&pool, &job, &rect, tile_rows);
+			thread_pool_wait(&pool, &job);
+		}
+		double ms = (double)(now_ns() - start) / iterations / 1000000;
+
+		thread_pool_finish(&pool);
+
+		if (threads == 1) {
+			base_ms = ms;
+		}
+		printf("%2zu threads: %7.2f ms/frame, speedup %5.2fx\n",
+			threads, ms, base_ms / ms);
+	}
+
+	free(src);
+	free(dst);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,67 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include <drm_fourcc.h>
+
+#include "dp.h"
+#include "pixel.h"
+#include "util.h"
+
+// Compares read-heavy rendering (blending) directly into a dumb buffer
+// mapping against rendering into a shadow buffer which is then flushed
+
+static const uint32_t width = 1920, height = 1080;
+static const int iterations = 20;
+
+static uint64_t render(struct framebuffer_dumb *fb, const uint32_t *src) {
+	uint64_t start = now_ns();
+	for (int i = 0; i < iterations; ++i) {
+		void *data = NULL;
+		framebuffer_dumb_map(fb, PROT_READ | PROT_WRITE, &data);
+		pixel_blend(data, fb->stride, src, width * 4, width, height, 0xC0);
+		framebuffer_dumb_damage_rows(fb, 0, height);
+		framebuffer_dumb_unmap(fb, data);
+	}
+	return now_ns() - start;
+}
+
+static void report(const char *name, uint64_t ns) {
+	double mpix = (double)width * height * iterations * 1000 / ns;
+	printf("%-8s %8.2f Mpixel/s, %6.2f ms/frame\n", name, mpix,
+		(double)ns / iterations / 1000000);
+}
+
+int main(int argc, char *argv[]) {
+	const char *device_path = "/dev/dri/card0";
+	if (argc == 2) {
+		device_path = argv[1];
+	}
+
+	struct device dev = { 0 };
+	device_init(&dev, device_path, 0);
+	printf("driver prefers shadow: %s\n",
+		dev.caps.prefer_shadow ? "yes" : "no");
+
+	uint32_t *src = xalloc((size_t)width * height * 4);
+	for (size_t i = 0; i < (size_t)width * height; ++i) {
+		src[i] = 0x80402010;
+	}
+
+	struct framebuffer_dumb fb = { 0 };
+	framebuffer_dumb_init(&fb, &dev, DRM_FORMAT_ARGB8888, width, height);
+
+	uint64_t direct_ns = render(&fb, src);
+	framebuffer_dumb_enable_shadow(&fb);
+	uint64_t shadow_ns = render(&fb, src);
+
+	report("direct", direct_ns);
+	report("shadow", shadow_ns);
+
+	device_restore(&dev);
+	framebuffer_dumb_finish(&fb);
+	free(src);
+	device_finish(&dev);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,134 @@
+#include <stddef.h>
+#include <sys/mman.h>
+
+#include <drm_fourcc.h>
+
+#include "dp.h"
+#include "pixel.h"
+#include "thread_pool.h"
+#include "util.h"
+
+// Tiles smaller than this aren't worth the scheduling overhead
+#define MIN_TILE_ROWS 16
+
+struct source {
+	struct framebuffer_dumb *fb;
+	const uint8_t *data;
+	struct rect rect; // in destination coordinates
+	uint8_t alpha;
+};
+
+struct composite_job {
+	uint8_t *dst;
+	uint32_t dst_stride;
+	const struct source *sources;
+	size_t sources_len;
+};
+
+// Row tiles are rendered on the pool
+void compositor_init(struct compositor *comp, struct thread_pool *pool) {
+	comp->pool = pool;
+}
+
+void compositor_finish(struct compositor *comp) {
+	// No-op
+}
+
+static struct framebuffer_dumb *dumb_from_fb(struct framebuffer *fb) {
+	return (struct framebuffer_dumb *)((uint8_t *)fb -
+		offsetof(struct framebuffer_dumb, fb));
+}
+
+static void composite_tile(void *data, const struct rect *rect) {
+	const struct composite_job *job = data;
+
+	uint8_t *dst = job->dst + (size_t)job->dst_stride * rect->y + rect->x * 4;
+	pixel_fill(dst, job->dst_stride, rect->width, rect->height, 0xFF000000);
+
+	for (size_t i = 0; i < job->sources_len; ++i) {
+		const struct source *src = &job->sources[i];
+
+		struct rect r;
+		if (!rect_intersect(&r, &src->rect, rect)) {
+			continue;
+		}
+
+		uint8_t *d = job->dst + (size_t)job->dst_stride * r.y + r.x * 4;
+		const uint8_t *s = src->data +
+			(size_t)src->fb->stride * (r.y - src->rect.y) +
+			(r.x - src->rect.x) * 4;
+
+		// XRGB8888 sources are opaque, their X channel can't be used for
+		// blending
+		bool opaque = src->fb->fb.format == DRM_FORMAT_XRGB8888;
+		if (opaque && src->alpha == 0xFF) {
+			pixel_copy(d, job->dst_stride, s, src->fb->stride,
+				r.width, r.height);
+		} else if (opaque) {
+			pixel_blend_opaque(d, job->dst_stride, s, src->fb->stride,
+				r.width, r.height, src->alpha);
+		} else {
+			pixel_blend(d, job->dst_stride, s, src->fb->stride,
+				r.width, r.height, src->alpha);
+		}
+	}
+}
+
+// Blends layers, ordered from bottom to top, into dst. Only the damaged region
+// is recomposited, on top of an opaque black background. Layer sources need
+// to be premultiplied ARGB8888 or XRGB8888 dumb framebuffers. They aren't
+// scaled: a layer larger than its framebuffer is clipped. Sources should have
+// a shadow, reading from the dumb buffer mapping is very slow.
+void compositor_composite(struct compositor *comp,
+		struct framebuffer_dumb *dst, const struct layer *layers,
+		size_t layers_len, const struct rect *damage) {
+	struct rect clip = { 0, 0, dst->fb.width, dst->fb.height };
+	struct rect region;
+	if (!rect_intersect(&region, damage, &clip)) {
+		return;
+	}
+
+	struct source sources[layers_len + 1];
+	for (size_t i = 0; i < layers_len; ++i) {
+		const struct layer *layer = &layers[i];
+		struct source *src = &sources[i];
+		src->fb = dumb_from_fb(layer->fb);
+		src->rect = (struct rect){
+			.x = layer->x,
+			.y = layer->y,
+			.width = layer->width < layer->fb->width ?
+				layer->width : layer->fb->width,
+			.height = layer->height < layer->fb->height ?
+				layer->height : layer->fb->height,
+		};
+		float alpha = layer->alpha < 0 ? 0 : layer->alpha > 1 ? 1 : layer->alpha;
+		src->alpha = alpha * 0xFF + 0.5f;
+
+		void *data = NULL;
+		framebuffer_dumb_map(src->fb, PROT_READ, &data);
+		src->data = data;
+	}
+
+	void *dst_data = NULL;
+	framebuffer_dumb_map(dst, PROT_READ | PROT_WRITE, &dst_data);
+	framebuffer_dumb_damage_rows(dst, region.y, region.height);
+
+	struct composite_job composite = {
+		.dst = dst_data,
+		.dst_stride = dst->stride,
+		.sources = sources,
+		.sources_len = layers_len,
+	};
+	struct thread_pool_job job = {
+		.func = composite_tile,
+		.data = &composite,
+	};
+	thread_pool_submit(comp->pool, &job, &region,
+		thread_pool_tile_rows(dst->stride, MIN_TILE_ROWS));
+	thread_pool_wait(comp->pool, &job);
+
+	framebuffer_dumb_unmap(dst, dst_data);
+	for (size_t i = 0; i < layers_len; ++i) {
+		framebuffer_dumb_unmap(sources[i].fb, (void *)sources[i].data);
+	}
+}
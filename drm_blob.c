@@ -0,0 +1,125 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dp_drm.h"
+#include "util.h"
+
+// Unreferenced blobs kept around in case the same contents come back
+#define BLOB_CACHE_MAX_UNUSED 8
+
+static uint64_t hash_data(const void *data, size_t size) {
+	// FNV-1a
+	const uint8_t *bytes = data;
+	uint64_t hash = 0xCBF29CE484222325;
+	for (size_t i = 0; i < size; ++i) {
+		hash ^= bytes[i];
+		hash *= 0x100000001B3;
+	}
+	return hash;
+}
+
+static void destroy_entry(struct device *dev, size_t idx) {
+	struct blob_entry *entry = &dev->blob_cache.entries[idx];
+
+	// The kernel keeps its own reference to blobs in use by the current state
+	drmModeDestroyPropertyBlob(dev->fd, entry->id);
+	free(entry->data);
+
+	--dev->blob_cache.len;
+	memmove(entry, entry + 1,
+		(dev->blob_cache.len - idx) * sizeof(struct blob_entry));
+}
+
+// Drops the least recently created unreferenced blobs over the limit
+static void evict_unused(struct device *dev) {
+	size_t unused = 0;
+	for (size_t i = 0; i < dev->blob_cache.len; ++i) {
+		if (dev->blob_cache.entries[i].refs == 0) {
+			++unused;
+		}
+	}
+
+	for (size_t i = 0; i < dev->blob_cache.len &&
+			unused > BLOB_CACHE_MAX_UNUSED;) {
+		if (dev->blob_cache.entries[i].refs == 0) {
+			destroy_entry(dev, i);
+			--unused;
+		} else {
+			++i;
+		}
+	}
+}
+
+// Returns a blob with the given contents, re-using an existing one if
+// possible. The reference must be released with device_blob_unref.
+uint32_t device_blob_ref(struct device *dev, const void *data, size_t size) {
+	uint64_t hash = hash_data(data, size);
+
+	for (size_t i = 0; i < dev->blob_cache.len; ++i) {
+		struct blob_entry *entry = &dev->blob_cache.entries[i];
+		if (entry->hash == hash && entry->size == size &&
+				memcmp(entry->data, data, size) == 0) {
+			++entry->refs;
+			++dev->blob_cache.hits;
+			return entry->id;
+		}
+	}
+
+	uint32_t blob_id;
+	if (drmModeCreatePropertyBlob(dev->fd, data, size, &blob_id) != 0) {
+		fatal_errno("drmModeCreatePropertyBlob failed");
+	}
+	++dev->blob_cache.misses;
+
+	if (dev->blob_cache.len == dev->blob_cache.cap) {
+		dev->blob_cache.cap = dev->blob_cache.cap ? 2 * dev->blob_cache.cap : 16;
+		dev->blob_cache.entries = xrealloc(dev->blob_cache.entries,
+			dev->blob_cache.cap * sizeof(struct blob_entry));
+	}
+
+	struct blob_entry *entry = &dev->blob_cache.entries[dev->blob_cache.len++];
+	*entry = (struct blob_entry){
+		.id = blob_id,
+		.hash = hash,
+		.data = xalloc(size),
+		.size = size,
+		.refs = 1,
+	};
+	memcpy(entry->data, data, size);
+
+	return blob_id;
+}
+
+// Blobs which weren't created by device_blob_ref, e.g. the ones found at init,
+// aren't owned by us and are left alone
+void device_blob_unref(struct device *dev, uint32_t blob_id) {
+	if (blob_id == 0) {
+		return;
+	}
+
+	for (size_t i = 0; i < dev->blob_cache.len; ++i) {
+		struct blob_entry *entry = &dev->blob_cache.entries[i];
+		if (entry->id != blob_id) {
+			continue;
+		}
+		if (entry->refs == 0) {
+			fatal("blob %"PRIu32" unreferenced too many times", blob_id);
+		}
+		if (--entry->refs == 0) {
+			evict_unused(dev);
+		}
+		return;
+	}
+}
+
+void device_blob_cache_finish(struct device *dev) {
+	printf("blob cache saved %zu of %zu blob creations\n",
+		dev->blob_cache.hits, dev->blob_cache.hits + dev->blob_cache.misses);
+
+	while (dev->blob_cache.len > 0) {
+		destroy_entry(dev, dev->blob_cache.len - 1);
+	}
+	free(dev->blob_cache.entries);
+}
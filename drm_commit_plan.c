@@ -0,0 +1,186 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <xf86drm.h>
+
+#include "dp_drm.h"
+#include "util.h"
+
+void commit_plan_init(struct commit_plan *plan, struct crtc *crtc) {
+	memset(plan, 0, sizeof(*plan));
+	plan->crtc = crtc;
+}
+
+void commit_plan_finish(struct commit_plan *plan) {
+	free(plan->entries);
+	free(plan->objs);
+	free(plan->count_props);
+	free(plan->props);
+	free(plan->values);
+	free(plan->sources);
+}
+
+// Records the pending values of all objects of the CRTC, in the same order as
+// crtc_commit
+static size_t update_objs(struct crtc *crtc, struct commit_plan_obj *objs) {
+	struct device *dev = crtc->dev;
+	size_t n = 0;
+
+	crtc_update(crtc, NULL, true);
+	objs[n++] = (struct commit_plan_obj){ crtc->id, &crtc->prop_state, 0 };
+
+	for (size_t i = 0; i < dev->connectors_len; ++i) {
+		struct connector *conn = &dev->connectors[i];
+		if (conn->crtc == crtc) {
+			connector_update(conn, NULL, true);
+			objs[n++] = (struct commit_plan_obj){
+				conn->id, &conn->prop_state, 0 };
+		}
+	}
+
+	for (size_t i = 0; i < dev->planes_len; ++i) {
+		struct plane *plane = &dev->planes[i];
+		if (plane->crtc == crtc) {
+			plane_update(plane, NULL, true);
+			objs[n++] = (struct commit_plan_obj){
+				plane->id, &plane->prop_state, 0 };
+		}
+	}
+
+	for (size_t i = 0; i < n; ++i) {
+		objs[i].mask = objs[i].state->pending_mask;
+	}
+
+	return n;
+}
+
+static bool layout_matches(struct commit_plan *plan,
+		const struct commit_plan_obj *objs, size_t objs_len) {
+	if (plan->entries_len != objs_len) {
+		return false;
+	}
+	for (size_t i = 0; i < objs_len; ++i) {
+		if (plan->entries[i].state != objs[i].state ||
+				plan->entries[i].mask != objs[i].mask) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static int obj_cmp(const void *arg1, const void *arg2) {
+	const struct commit_plan_obj *a = arg1, *b = arg2;
+
+	if (a->id < b->id) {
+		return -1;
+	}
+	return a->id > b->id;
+}
+
+static void build_layout(struct commit_plan *plan,
+		const struct commit_plan_obj *objs, size_t objs_len) {
+	printf("building commit plan for CRTC %"PRIu32"\n", plan->crtc->id);
+
+	commit_plan_finish(plan);
+
+	size_t entries_size = objs_len * sizeof(struct commit_plan_obj);
+	plan->entries = xalloc(entries_size);
+	memcpy(plan->entries, objs, entries_size);
+	plan->entries_len = objs_len;
+
+	// The kernel wants properties grouped by object, sort them like libdrm
+	struct commit_plan_obj sorted[objs_len + 1];
+	memcpy(sorted, objs, entries_size);
+	qsort(sorted, objs_len, sizeof(sorted[0]), obj_cmp);
+
+	size_t props_len = 0;
+	for (size_t i = 0; i < objs_len; ++i) {
+		props_len += __builtin_popcount(sorted[i].mask);
+	}
+
+	plan->objs = xalloc(objs_len * sizeof(uint32_t));
+	plan->count_props = xalloc(objs_len * sizeof(uint32_t));
+	plan->objs_len = objs_len;
+	plan->props = xalloc(props_len * sizeof(uint32_t));
+	plan->values = xalloc(props_len * sizeof(uint64_t));
+	plan->sources = xalloc(props_len * sizeof(uint64_t *));
+	plan->props_len = props_len;
+
+	size_t k = 0;
+	for (size_t i = 0; i < objs_len; ++i) {
+		const struct obj_state *state = sorted[i].state;
+		plan->objs[i] = sorted[i].id;
+
+		size_t first = k;
+		for (size_t j = 0; j < state->len; ++j) {
+			if (!(sorted[i].mask & (1 << j))) {
+				continue;
+			}
+
+			// Insertion sort by property ID, objects have few properties
+			size_t pos = k;
+			while (pos > first && plan->props[pos - 1] > state->prop_ids[j]) {
+				plan->props[pos] = plan->props[pos - 1];
+				plan->sources[pos] = plan->sources[pos - 1];
+				--pos;
+			}
+			plan->props[pos] = state->prop_ids[j];
+			plan->sources[pos] = &state->pending[j];
+			++k;
+		}
+		plan->count_props[i] = k - first;
+	}
+}
+
+// Fills the property values of the request, without submitting it
+void commit_plan_prepare(struct commit_plan *plan) {
+	struct device *dev = plan->crtc->dev;
+
+	struct commit_plan_obj objs[1 + dev->connectors_len + dev->planes_len];
+	size_t objs_len = update_objs(plan->crtc, objs);
+	if (!layout_matches(plan, objs, objs_len)) {
+		build_layout(plan, objs, objs_len);
+	}
+
+	for (size_t i = 0; i < plan->props_len; ++i) {
+		plan->values[i] = *plan->sources[i];
+	}
+}
+
+// Returns 0 on success, a negative errno value if the kernel rejected the
+// commit
+int commit_plan_commit(struct commit_plan *plan, uint32_t flags) {
+	struct device *dev = plan->crtc->dev;
+
+	commit_plan_prepare(plan);
+
+	struct drm_mode_atomic atomic = {
+		.flags = flags,
+		.count_objs = plan->objs_len,
+		.objs_ptr = (uint64_t)(uintptr_t)plan->objs,
+		.count_props_ptr = (uint64_t)(uintptr_t)plan->count_props,
+		.props_ptr = (uint64_t)(uintptr_t)plan->props,
+		.prop_values_ptr = (uint64_t)(uintptr_t)plan->values,
+		.user_data = (uint64_t)(uintptr_t)dev,
+	};
+	int ret = drmIoctl(dev->fd, DRM_IOCTL_MODE_ATOMIC, &atomic);
+	if (ret != 0) {
+		ret = -errno;
+	}
+	device_handle_commit(dev, flags, ret);
+	if (ret != 0) {
+		return ret;
+	}
+
+	if ((flags & DRM_MODE_PAGE_FLIP_EVENT) &&
+			!(flags & DRM_MODE_ATOMIC_TEST_ONLY)) {
+		frame_stats_submit(&plan->crtc->stats);
+		plan->crtc->flip_pending = true;
+		if (plan->crtc->commit_handler != NULL) {
+			plan->crtc->commit_handler(plan->crtc, 0, plan->crtc->page_flip_data);
+		}
+	}
+	return 0;
+}
@@ -6,8 +6,25 @@
 #include "dp_drm.h"
 #include "util.h"
 
+static void read_modes(struct connector *conn, const drmModeConnector *drm_conn) {
+	conn->state = drm_conn->connection;
+
+	free(conn->modes);
+	conn->modes = NULL;
+	conn->modes_len = 0;
+	if (drm_conn->count_modes > 0) {
+		size_t modes_size = drm_conn->count_modes * sizeof(drmModeModeInfo);
+		conn->modes = xalloc(modes_size);
+		memcpy(conn->modes, drm_conn->modes, modes_size);
+		conn->modes_len = drm_conn->count_modes;
+	}
+}
+
+// Without probe, the connection state and the modes are the ones the kernel
+// found during its last probe, which doesn't touch the hardware
 void connector_init(struct connector *conn, struct device *dev,
-		uint32_t conn_id, struct encoder *encoders, size_t encoders_len) {
+		uint32_t conn_id, struct encoder *encoders, size_t encoders_len,
+		bool probe) {
 	printf("initializing connector %"PRIu32"\n", conn_id);
 
 	conn->dev = dev;
@@ -18,30 +35,28 @@ void connector_init(struct connector *conn, struct device *dev,
 		{ "CRTC_ID", &conn->props.crtc_id, &crtc_id, true },
 	};
 	read_obj_props(dev, conn_id, DRM_MODE_OBJECT_CONNECTOR, conn_props,
-		sizeof(conn_props) / sizeof(conn_props[0]));
+		sizeof(conn_props) / sizeof(conn_props[0]), &conn->snapshot);
+	obj_state_init_value(&conn->prop_state, conn_id, conn->props.crtc_id,
+		crtc_id);
 
-	drmModeConnector *drm_conn = drmModeGetConnector(dev->fd, conn_id);
+	drmModeConnector *drm_conn = probe ?
+		drmModeGetConnector(dev->fd, conn_id) :
+		drmModeGetConnectorCurrent(dev->fd, conn_id);
 	if (!drm_conn) {
 		fatal_errno("failed to get connector %"PRIu32, conn_id);
 	}
 
 	conn->type = drm_conn->connector_type;
-	conn->state = drm_conn->connection;
-
-	if (drm_conn->count_modes > 0) {
-		size_t modes_size = drm_conn->count_modes * sizeof(drmModeModeInfo);
-		conn->modes = xalloc(modes_size);
-		memcpy(conn->modes, drm_conn->modes, modes_size);
-		conn->modes_len = drm_conn->count_modes;
-	}
+	conn->probed = probe;
+	read_modes(conn, drm_conn);
 
 	conn->possible_crtcs = (uint32_t)~0;
 	for (int i = 0; i < drm_conn->count_encoders; ++i) {
 		uint32_t enc_id = drm_conn->encoders[i];
 		bool found = false;
-		for (size_t j = 0; j < encoders_len; ++i) {
-			if (encoders[i].id == enc_id) {
-				conn->possible_crtcs &= encoders[i].possible_crtcs;
+		for (size_t j = 0; j < encoders_len; ++j) {
+			if (encoders[j].id == enc_id) {
+				conn->possible_crtcs &= encoders[j].possible_crtcs;
 				found = true;
 				break;
 			}
@@ -56,20 +71,26 @@ void connector_init(struct connector *conn, struct device *dev,
 
 	drmModeFreeConnector(drm_conn);
 
-	conn->old_crtc = drmModeGetCrtc(dev->fd, crtc_id);
 	conn->crtc = device_find_crtc(dev, crtc_id);
 }
 
-void connector_finish(struct connector *conn) {
-	struct device *dev = conn->dev;
-
-	drmModeCrtc *c = conn->old_crtc;
-	if (c != NULL) {
-		drmModeSetCrtc(dev->fd, c->crtc_id, c->buffer_id, c->x, c->y,
-			&conn->id, 1, &c->mode);
-		drmModeFreeCrtc(conn->old_crtc);
+// Forces the kernel to probe the connector, e.g. read the EDID, and refreshes
+// the connection state and the modes. This can take hundreds of milliseconds.
+void connector_probe(struct connector *conn) {
+	uint64_t start_ns = now_ns();
+	drmModeConnector *drm_conn = drmModeGetConnector(conn->dev->fd, conn->id);
+	if (!drm_conn) {
+		fatal_errno("failed to probe connector %"PRIu32, conn->id);
 	}
+	read_modes(conn, drm_conn);
+	drmModeFreeConnector(drm_conn);
+	conn->probed = true;
 
+	printf("probed connector %"PRIu32" in %"PRIu64" us\n", conn->id,
+		(now_ns() - start_ns) / 1000);
+}
+
+void connector_finish(struct connector *conn) {
 	free(conn->modes);
 }
 
@@ -91,7 +112,9 @@ bool connector_set_crtc(struct connector *conn, struct crtc *crtc) {
 	return true;
 }
 
-void connector_update(struct connector *conn, drmModeAtomicReq *req) {
+void connector_update(struct connector *conn, drmModeAtomicReq *req,
+		bool full) {
 	uint32_t crtc_id = (conn->crtc != NULL) ? conn->crtc->id : 0;
-	drmModeAtomicAddProperty(req, conn->id, conn->props.crtc_id, crtc_id);
+	obj_state_add(&conn->prop_state, req, conn->id, conn->props.crtc_id, crtc_id,
+		full);
 }
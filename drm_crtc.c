@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,6 +10,7 @@
 void crtc_init(struct crtc *crtc, struct device *dev, uint32_t crtc_id) {
 	crtc->dev = dev;
 	crtc->id = crtc_id;
+	crtc->full_commit = true;
 
 	uint32_t active, mode_id;
 	struct prop crtc_props[] = {
@@ -16,66 +18,111 @@ void crtc_init(struct crtc *crtc, struct device *dev, uint32_t crtc_id) {
 		{ "MODE_ID", &crtc->props.mode_id, &mode_id, true },
 	};
 	read_obj_props(dev, crtc_id, DRM_MODE_OBJECT_CRTC, crtc_props,
-		sizeof(crtc_props) / sizeof(crtc_props[0]));
+		sizeof(crtc_props) / sizeof(crtc_props[0]), &crtc->snapshot);
 
 	crtc->active = active;
 	crtc->mode_id = mode_id;
+	obj_state_init_value(&crtc->prop_state, crtc_id, crtc->props.active,
+		active);
+	obj_state_init_value(&crtc->prop_state, crtc_id, crtc->props.mode_id,
+		mode_id);
 
 	if (mode_id != 0) {
 		drmModePropertyBlobRes *blob = drmModeGetPropertyBlob(dev->fd, mode_id);
 		if (blob == NULL) {
 			fatal_errno("failed to get MODE_ID blob");
 		}
-		drmModeModeInfo *mode = blob->data;
-		crtc->mode = xalloc(sizeof(drmModeModeInfo));
-		memcpy(crtc->mode, mode, sizeof(drmModeModeInfo));
+		memcpy(&crtc->mode_info, blob->data, sizeof(crtc->mode_info));
+		crtc->mode = &crtc->mode_info;
 		drmModeFreePropertyBlob(blob);
 	}
 }
 
 void crtc_finish(struct crtc *crtc) {
-	struct device *dev = crtc->dev;
-
-	if (crtc->mode_id != 0) {
-		drmModeDestroyPropertyBlob(dev->fd, crtc->mode_id);
-	}
-
-	free(crtc->mode);
+	device_blob_unref(crtc->dev, crtc->mode_id);
 }
 
-void crtc_update(struct crtc *crtc, drmModeAtomicReq *req) {
-	drmModeAtomicAddProperty(req, crtc->id, crtc->props.mode_id, crtc->mode_id);
-	drmModeAtomicAddProperty(req, crtc->id, crtc->props.active,
-		crtc->mode_id != 0 && crtc->active);
+void crtc_update(struct crtc *crtc, drmModeAtomicReq *req, bool full) {
+	obj_state_add(&crtc->prop_state, req, crtc->id, crtc->props.mode_id,
+		crtc->mode_id, full);
+	obj_state_add(&crtc->prop_state, req, crtc->id, crtc->props.active,
+		crtc->mode_id != 0 && crtc->active, full);
 }
 
-void crtc_commit(struct crtc *crtc, uint32_t flags, void *user_data) {
+// Adds the CRTC, its connectors and its planes to the request
+void crtc_add_to_request(struct crtc *crtc, drmModeAtomicReq *req, bool full,
+		uint32_t flags) {
 	struct device *dev = crtc->dev;
-	int cursor = drmModeAtomicGetCursor(dev->atomic_req);
+	int cursor = drmModeAtomicGetCursor(req);
 
-	crtc_update(crtc, dev->atomic_req);
+	crtc_update(crtc, req, full);
 
 	for (size_t i = 0; i < dev->connectors_len; ++i) {
 		struct connector *conn = &dev->connectors[i];
 		if (conn->crtc == crtc) {
-			connector_update(conn, dev->atomic_req);
+			connector_update(conn, req, full);
 		}
 	}
 
 	for (size_t i = 0; i < dev->planes_len; ++i) {
 		struct plane *plane = &dev->planes[i];
 		if (plane->crtc == crtc) {
-			plane_update(plane, dev->atomic_req);
+			plane_update(plane, req, full);
 		}
 	}
 
-	if (drmModeAtomicCommit(dev->fd, dev->atomic_req, flags, user_data)) {
+	// The kernel needs at least one property of the CRTC to send an event
+	if (drmModeAtomicGetCursor(req) == cursor &&
+			(flags & DRM_MODE_PAGE_FLIP_EVENT)) {
+		crtc_update(crtc, req, true);
+	}
+}
+
+static bool is_page_flip(uint32_t flags) {
+	uint32_t required = DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_NONBLOCK;
+	uint32_t forbidden = DRM_MODE_ATOMIC_TEST_ONLY |
+		DRM_MODE_ATOMIC_ALLOW_MODESET;
+	return (flags & required) == required && (flags & forbidden) == 0;
+}
+
+// Non-blocking page-flips have mailbox semantics: if a page-flip is still
+// pending, the commit is deferred until its event arrives, see
+// crtc_request_commit. Further changes made in the meantime are merged into
+// the deferred commit.
+void crtc_commit(struct crtc *crtc, uint32_t flags) {
+	if (!is_page_flip(flags)) {
+		device_commit_crtcs(crtc->dev, &crtc, 1, flags);
+		return;
+	}
+
+	if (crtc->flip_pending) {
+		crtc_request_commit(crtc);
+		return;
+	}
+
+	// The kernel may know about a pending commit we don't track
+	int ret = crtc_try_commit(crtc, flags);
+	if (ret == -EBUSY) {
+		crtc_request_commit(crtc);
+	} else if (ret != 0) {
+		errno = -ret;
 		fatal_errno("drmModeAtomicCommit failed");
 	}
+}
+
+// Returns a negative errno value if the kernel rejected the commit
+int crtc_try_commit(struct crtc *crtc, uint32_t flags) {
+	return device_try_commit_crtcs(crtc->dev, &crtc, 1, flags);
+}
 
-	drmModeAtomicSetCursor(dev->atomic_req, cursor);
+// The commit is sent on the next device_flush, together with the other CRTCs
+// ready at that time. If a page-flip is pending, it waits for the event.
+void crtc_request_commit(struct crtc *crtc) {
+	crtc->commit_requested = true;
 }
 
+// Only the timings matter to the hardware. The name and type of the mode
+// read from the current MODE_ID blob may differ from the connector's list.
 static bool compare_modes(const drmModeModeInfo *a, const drmModeModeInfo *b) {
 	if (a == NULL && b == NULL) {
 		return true;
@@ -83,7 +130,13 @@ static bool compare_modes(const drmModeModeInfo *a, const drmModeModeInfo *b) {
 	if (a == NULL || b == NULL) {
 		return false;
 	}
-	return memcmp(a, b, sizeof(drmModeModeInfo)) == 0;
+	return a->clock == b->clock &&
+		a->hdisplay == b->hdisplay && a->hsync_start == b->hsync_start &&
+		a->hsync_end == b->hsync_end && a->htotal == b->htotal &&
+		a->hskew == b->hskew &&
+		a->vdisplay == b->vdisplay && a->vsync_start == b->vsync_start &&
+		a->vsync_end == b->vsync_end && a->vtotal == b->vtotal &&
+		a->vscan == b->vscan && a->flags == b->flags;
 }
 
 void crtc_set_mode(struct crtc *crtc, const drmModeModeInfo *mode) {
@@ -93,27 +146,40 @@ void crtc_set_mode(struct crtc *crtc, const drmModeModeInfo *mode) {
 		return;
 	}
 
-	if (crtc->mode_id != 0) {
-		drmModeDestroyPropertyBlob(dev->fd, crtc->mode_id);
-		crtc->mode_id = 0;
-
-		free(crtc->mode);
-		crtc->mode = NULL;
-	}
+	// Unreferenced mode blobs stay cached, switching back to a previous mode
+	// re-uses its blob. The mode itself is stored in the CRTC, so switching
+	// doesn't allocate.
+	device_blob_unref(dev, crtc->mode_id);
+	crtc->mode_id = 0;
+	crtc->mode = NULL;
 
 	if (mode == NULL) {
 		printf("assigning NULL mode to CRTC %"PRIu32"\n", crtc->id);
 		return;
 	}
 
-	if (drmModeCreatePropertyBlob(dev->fd, mode, sizeof(*mode),
-			&crtc->mode_id)) {
-		fatal_errno("failed to create DRM property blob for mode");
-	}
-
-	crtc->mode = xalloc(sizeof(*crtc->mode));
-	memcpy(crtc->mode, mode, sizeof(*crtc->mode));
+	crtc->mode_id = device_blob_ref(dev, mode, sizeof(*mode));
+	crtc->mode_info = *mode;
+	crtc->mode = &crtc->mode_info;
 
 	printf("assigning mode %"PRIu32"x%"PRIu32" to CRTC %"PRIu32"\n",
 		mode->hdisplay, mode->vdisplay, crtc->id);
 }
+
+// Must be called when a page-flip event is received for the CRTC
+void crtc_handle_page_flip(struct crtc *crtc, unsigned int sequence,
+		unsigned int tv_sec, unsigned int tv_usec) {
+	crtc->flip_pending = false;
+	if (crtc->cursor_flip) {
+		// The displayed frame didn't change
+		crtc->cursor_flip = false;
+		return;
+	}
+
+	uint64_t flip_ns = (uint64_t)tv_sec * 1000000000 + (uint64_t)tv_usec * 1000;
+	frame_stats_page_flip(&crtc->stats, sequence, flip_ns);
+
+	if (crtc->page_flip_handler != NULL) {
+		crtc->page_flip_handler(crtc, crtc->page_flip_data);
+	}
+}
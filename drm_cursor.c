@@ -0,0 +1,157 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <xf86drm.h>
+
+#include "dp_drm.h"
+#include "util.h"
+
+// Takes the first cursor plane usable by the CRTC and not used by another one.
+// Returns false if there is none.
+bool cursor_init(struct cursor *cursor, struct crtc *crtc) {
+	struct device *dev = crtc->dev;
+	size_t crtc_idx = crtc - dev->crtcs;
+
+	memset(cursor, 0, sizeof(*cursor));
+	cursor->crtc = crtc;
+	cursor->async = dev->caps.atomic_async_page_flip;
+
+	for (size_t i = 0; i < dev->planes_len; ++i) {
+		struct plane *plane = &dev->planes[i];
+		if (plane->type != DRM_PLANE_TYPE_CURSOR ||
+				(plane->possible_crtcs & (1 << crtc_idx)) == 0 ||
+				(plane->crtc != NULL && plane->crtc != crtc)) {
+			continue;
+		}
+		if (!plane_set_crtc(plane, crtc)) {
+			continue;
+		}
+
+		cursor->plane = plane;
+		crtc->cursor = cursor;
+		printf("using plane %"PRIu32" as cursor for CRTC %"PRIu32"\n",
+			plane->id, crtc->id);
+		return true;
+	}
+
+	return false;
+}
+
+// The cursor plane keeps its framebuffer, see cursor_set_image
+void cursor_finish(struct cursor *cursor) {
+	struct crtc *crtc = cursor->crtc;
+
+	printf("cursor of CRTC %"PRIu32": %"PRIu64" updates in %"PRIu64" commits\n",
+		crtc->id, cursor->updates, cursor->commits);
+
+	crtc->cursor = NULL;
+	crtc->cursor_requested = false;
+}
+
+static void request_update(struct cursor *cursor) {
+	++cursor->updates;
+	cursor->crtc->cursor_requested = true;
+}
+
+// A NULL framebuffer hides the cursor
+void cursor_set_image(struct cursor *cursor, struct framebuffer *fb) {
+	struct plane *plane = cursor->plane;
+
+	plane_set_framebuffer(plane, fb);
+	if (fb != NULL) {
+		plane->width = fb->width;
+		plane->height = fb->height;
+		plane->alpha = 1.0;
+	}
+	request_update(cursor);
+}
+
+// The update is sent by the next device_flush, merged with the commit of the
+// CRTC if one is requested. Otherwise only the changed properties of the
+// cursor plane are submitted. While a page-flip is pending, further updates
+// are coalesced.
+void cursor_move(struct cursor *cursor, uint32_t x, uint32_t y) {
+	struct plane *plane = cursor->plane;
+
+	if (plane->x == x && plane->y == y) {
+		return;
+	}
+	plane->x = x;
+	plane->y = y;
+	request_update(cursor);
+}
+
+static int commit(struct cursor *cursor, uint32_t flags) {
+	struct crtc *crtc = cursor->crtc;
+	struct device *dev = crtc->dev;
+	int req_cursor = drmModeAtomicGetCursor(dev->atomic_req);
+
+	plane_update(cursor->plane, dev->atomic_req, crtc->full_commit);
+	if (drmModeAtomicGetCursor(dev->atomic_req) == req_cursor) {
+		return 0;
+	}
+
+	int ret = drmModeAtomicCommit(dev->fd, dev->atomic_req, flags, dev);
+	if (ret != 0) {
+		ret = -errno;
+	}
+
+	// Only the cursor plane was in the request, so the CRTC still needs a full
+	// commit if it did before
+	device_handle_commit(dev, flags, ret);
+
+	if (ret == 0) {
+		++cursor->commits;
+		crtc->flip_pending = true;
+		crtc->cursor_flip = true;
+	}
+
+	drmModeAtomicSetCursor(dev->atomic_req, req_cursor);
+	return ret;
+}
+
+// Atomic async page-flips may only change FB_ID: moving the cursor is always
+// rejected
+static bool only_image_changed(struct cursor *cursor) {
+	struct plane *plane = cursor->plane;
+	struct obj_state *state = &plane->prop_state;
+
+	if (cursor->crtc->full_commit) {
+		return false;
+	}
+
+	plane_update(plane, NULL, false);
+	bool only_fb = obj_state_changed(state, plane->props.fb_id);
+	for (size_t i = 0; i < state->len; ++i) {
+		if (state->prop_ids[i] != plane->props.fb_id &&
+				obj_state_changed(state, state->prop_ids[i])) {
+			only_fb = false;
+		}
+	}
+	obj_state_discard(state);
+
+	return only_fb;
+}
+
+// Sends a request with only the cursor plane. Returns a negative errno value
+// if the kernel rejected the commit.
+int cursor_commit(struct cursor *cursor) {
+	uint32_t flags = DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_NONBLOCK;
+
+	// Async updates are only attempted when the image changes on its own,
+	// anything else would be rejected regardless of the driver
+	if (cursor->async && only_image_changed(cursor)) {
+		// Drivers may still refuse to flip the cursor plane asynchronously
+		int ret = commit(cursor, flags | DRM_MODE_PAGE_FLIP_ASYNC);
+		if (ret != -EINVAL) {
+			return ret;
+		}
+		printf("async cursor updates rejected on CRTC %"PRIu32"\n",
+			cursor->crtc->id);
+		cursor->async = false;
+	}
+
+	return commit(cursor, flags);
+}
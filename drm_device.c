@@ -1,14 +1,50 @@
+#include <errno.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 
 #include <xf86drm.h>
 
 #include "dp_drm.h"
+#include "thread_pool.h"
 #include "util.h"
 
-void device_init(struct device *dev, const char *path) {
+#define INIT_THREADS 4
+
+// Connectors or planes to initialize. The rows of the rect passed to the
+// init functions are object indices.
+struct init_objs {
+	struct device *dev;
+	const uint32_t *ids;
+
+	// For connectors
+	struct encoder *encoders;
+	size_t encoders_len;
+	bool probe;
+};
+
+static void init_connectors(void *data, const struct rect *rows) {
+	struct init_objs *objs = data;
+	for (uint32_t i = rows->y; i < rows->y + rows->height; ++i) {
+		connector_init(&objs->dev->connectors[i], objs->dev, objs->ids[i],
+			objs->encoders, objs->encoders_len, objs->probe);
+	}
+}
+
+static void init_planes(void *data, const struct rect *rows) {
+	struct init_objs *objs = data;
+	for (uint32_t i = rows->y; i < rows->y + rows->height; ++i) {
+		plane_init(&objs->dev->planes[i], objs->dev, objs->ids[i]);
+	}
+}
+
+// With DEVICE_INIT_FAST_PROBE, connectors aren't probed, see connector_probe.
+// With DEVICE_INIT_PARALLEL, connectors and planes are initialized from a
+// thread pool, once all CRTCs are.
+void device_init(struct device *dev, const char *path, uint32_t flags) {
 	printf("opening device \"%s\"\n", path);
 
 	dev->fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
@@ -29,6 +65,26 @@ void device_init(struct device *dev, const char *path) {
 	}
 	dev->caps.dumb = has_dumb;
 
+	uint64_t prefer_shadow;
+	if (drmGetCap(dev->fd, DRM_CAP_DUMB_PREFER_SHADOW, &prefer_shadow) != 0) {
+		prefer_shadow = 0;
+	}
+	dev->caps.prefer_shadow = prefer_shadow;
+
+	uint64_t crtc_in_vblank_event;
+	if (drmGetCap(dev->fd, DRM_CAP_CRTC_IN_VBLANK_EVENT,
+			&crtc_in_vblank_event) != 0) {
+		crtc_in_vblank_event = 0;
+	}
+	dev->caps.crtc_in_vblank_event = crtc_in_vblank_event;
+
+	uint64_t async_page_flip;
+	if (drmGetCap(dev->fd, DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP,
+			&async_page_flip) != 0) {
+		async_page_flip = 0;
+	}
+	dev->caps.atomic_async_page_flip = async_page_flip;
+
 	uint64_t cursor_width, cursor_height;
 	if (drmGetCap(dev->fd, DRM_CAP_CURSOR_WIDTH, &cursor_width) != 0) {
 		fatal("drmGetCap(DRM_CAP_CURSOR_WIDTH) failed");
@@ -43,7 +99,9 @@ void device_init(struct device *dev, const char *path) {
 	if (!dev->atomic_req) {
 		fatal_errno("drmModeAtomicAlloc failed");
 	}
+	pthread_mutex_init(&dev->prop_cache.mutex, NULL);
 
+	uint64_t start_ns = now_ns();
 	drmModeRes *res = drmModeGetResources(dev->fd);
 	if (!res) {
 		fatal("drmModeGetResources failed");
@@ -62,6 +120,7 @@ void device_init(struct device *dev, const char *path) {
 		};
 		drmModeFreeEncoder(enc);
 	}
+	uint64_t encoders_ns = now_ns();
 
 	// CRTCs need to be initialized before connectors
 	dev->crtcs = xalloc(res->count_crtcs * sizeof(struct crtc));
@@ -70,34 +129,153 @@ void device_init(struct device *dev, const char *path) {
 		crtc_init(crtc, dev, res->crtcs[i]);
 		++dev->crtcs_len;
 	}
+	uint64_t crtcs_ns = now_ns();
+
+	drmModePlaneRes *plane_res = drmModeGetPlaneResources(dev->fd);
+	if (!plane_res) {
+		fatal("drmModeGetPlaneResources failed");
+	}
 
 	dev->connectors = xalloc(res->count_connectors * sizeof(struct connector));
-	for (int i = 0; i < res->count_connectors; ++i) {
-		struct connector *conn = &dev->connectors[dev->connectors_len];
-		connector_init(conn, dev, res->connectors[i], encoders, encoders_len);
-		++dev->connectors_len;
+	dev->planes = xalloc(plane_res->count_planes * sizeof(struct plane));
+
+	struct init_objs conns = {
+		.dev = dev,
+		.ids = res->connectors,
+		.encoders = encoders,
+		.encoders_len = encoders_len,
+		.probe = !(flags & DEVICE_INIT_FAST_PROBE),
+	};
+	struct init_objs planes = { .dev = dev, .ids = plane_res->planes };
+	struct rect conns_rect = { 0, 0, 1, res->count_connectors };
+	struct rect planes_rect = { 0, 0, 1, plane_res->count_planes };
+
+	uint64_t connectors_ns;
+	if (flags & DEVICE_INIT_PARALLEL) {
+		struct thread_pool pool;
+		thread_pool_init(&pool, INIT_THREADS);
+
+		struct thread_pool_job conns_job = {
+			.func = init_connectors,
+			.data = &conns,
+		};
+		struct thread_pool_job planes_job = {
+			.func = init_planes,
+			.data = &planes,
+		};
+		thread_pool_submit(&pool, &conns_job, &conns_rect, 1);
+		thread_pool_submit(&pool, &planes_job, &planes_rect, 1);
+		thread_pool_wait(&pool, &conns_job);
+		thread_pool_wait(&pool, &planes_job);
+
+		thread_pool_finish(&pool);
+		connectors_ns = now_ns();
+	} else {
+		init_connectors(&conns, &conns_rect);
+		connectors_ns = now_ns();
+		init_planes(&planes, &planes_rect);
 	}
+	dev->connectors_len = res->count_connectors;
+	dev->planes_len = plane_res->count_planes;
+	uint64_t planes_ns = now_ns();
 
 	free(encoders);
-
 	drmModeFreeResources(res);
+	drmModeFreePlaneResources(plane_res);
 
-	drmModePlaneRes *plane_res = drmModeGetPlaneResources(dev->fd);
-	if (!res) {
-		fatal("drmModeGetPlaneResources failed");
+	printf("enumeration took %"PRIu64" us: encoders %"PRIu64" us, "
+		"CRTCs %"PRIu64" us\n", (planes_ns - start_ns) / 1000,
+		(encoders_ns - start_ns) / 1000, (crtcs_ns - encoders_ns) / 1000);
+	if (flags & DEVICE_INIT_PARALLEL) {
+		printf("connectors (%s) and planes in parallel: %"PRIu64" us\n",
+			conns.probe ? "probed" : "cached", (planes_ns - crtcs_ns) / 1000);
+	} else {
+		printf("connectors (%s): %"PRIu64" us, planes: %"PRIu64" us\n",
+			conns.probe ? "probed" : "cached",
+			(connectors_ns - crtcs_ns) / 1000,
+			(planes_ns - connectors_ns) / 1000);
 	}
+	printf("property cache saved %zu of %zu drmModeGetProperty calls\n",
+		dev->prop_cache.hits, dev->prop_cache.hits + dev->prop_cache.misses);
+}
 
-	dev->planes = xalloc(plane_res->count_planes * sizeof(struct plane));
-	for (uint32_t i = 0; i < plane_res->count_planes; ++i) {
-		struct plane *plane = &dev->planes[dev->planes_len];
-		plane_init(plane, dev, plane_res->planes[i]);
-		++dev->planes_len;
+// Blob IDs are re-used once a blob is destroyed, so the contents are checked
+static uint64_t restore_blob(struct device *dev, const struct saved_prop *prop) {
+	drmModePropertyBlobRes *blob = drmModeGetPropertyBlob(dev->fd, prop->value);
+	bool exists = blob != NULL && blob->length == prop->blob_size &&
+		memcmp(blob->data, prop->blob_data, prop->blob_size) == 0;
+	drmModeFreePropertyBlob(blob);
+	if (exists) {
+		return prop->value;
 	}
 
-	drmModeFreePlaneResources(plane_res);
+	// Kept until the blob cache is destroyed, the kernel holds its own
+	// reference once committed
+	return device_blob_ref(dev, prop->blob_data, prop->blob_size);
+}
+
+static void add_snapshot(struct device *dev, drmModeAtomicReq *req,
+		uint32_t obj_id, struct obj_snapshot *snapshot) {
+	for (size_t i = 0; i < snapshot->len; ++i) {
+		const struct saved_prop *prop = &snapshot->props[i];
+		uint64_t value = prop->value;
+		if (prop->blob_data != NULL) {
+			value = restore_blob(dev, prop);
+		}
+		drmModeAtomicAddProperty(req, obj_id, prop->prop_id, value);
+	}
+	obj_snapshot_finish(snapshot);
+}
+
+// Puts back the state found by device_init in a single atomic commit, with a
+// modeset only if the kernel says it's needed. This must happen before
+// destroying framebuffers still on screen, which the kernel would otherwise
+// disable first. device_finish calls it if it hasn't been called yet.
+void device_restore(struct device *dev) {
+	drmModeAtomicReq *req = drmModeAtomicAlloc();
+	if (!req) {
+		fatal_errno("drmModeAtomicAlloc failed");
+	}
+
+	// Our view of the kernel state no longer holds, the next commit needs to
+	// set everything again
+	for (size_t i = 0; i < dev->crtcs_len; ++i) {
+		struct crtc *crtc = &dev->crtcs[i];
+		add_snapshot(dev, req, crtc->id, &crtc->snapshot);
+		obj_state_forget(&crtc->prop_state);
+		crtc->full_commit = true;
+	}
+	for (size_t i = 0; i < dev->connectors_len; ++i) {
+		struct connector *conn = &dev->connectors[i];
+		add_snapshot(dev, req, conn->id, &conn->snapshot);
+		obj_state_forget(&conn->prop_state);
+	}
+	for (size_t i = 0; i < dev->planes_len; ++i) {
+		struct plane *plane = &dev->planes[i];
+		add_snapshot(dev, req, plane->id, &plane->snapshot);
+		obj_state_forget(&plane->prop_state);
+	}
+
+	if (drmModeAtomicGetCursor(req) > 0) {
+		int ret = drmModeAtomicCommit(dev->fd, req, 0, NULL);
+		if (ret != 0 && errno == EINVAL) {
+			printf("restoring the initial state requires a modeset\n");
+			ret = drmModeAtomicCommit(dev->fd, req,
+				DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
+		}
+		if (ret != 0) {
+			// The previous framebuffers may be gone
+			fprintf(stderr, "failed to restore the initial state: %s\n",
+				strerror(errno));
+		}
+	}
+
+	drmModeAtomicFree(req);
 }
 
 void device_finish(struct device *dev) {
+	device_restore(dev);
+
 	for (size_t i = 0; i < dev->planes_len; ++i) {
 		plane_finish(&dev->planes[i]);
 	}
@@ -113,6 +291,8 @@ void device_finish(struct device *dev) {
 	free(dev->planes);
 	free(dev->crtcs);
 	free(dev->connectors);
+	device_blob_cache_finish(dev);
+	device_prop_cache_finish(dev);
 	drmModeAtomicFree(dev->atomic_req);
 	close(dev->fd);
 }
@@ -131,24 +311,267 @@ struct crtc *device_find_crtc(struct device *dev, uint32_t crtc_id) {
 	return NULL;
 }
 
+// Returns true if the pending connector routing or CRTC modes differ from the
+// ones last committed, or found at init
+static bool pending_modeset(struct device *dev) {
+	for (size_t i = 0; i < dev->connectors_len; ++i) {
+		struct connector *conn = &dev->connectors[i];
+		if (obj_state_changed(&conn->prop_state, conn->props.crtc_id)) {
+			return true;
+		}
+	}
+
+	for (size_t i = 0; i < dev->crtcs_len; ++i) {
+		struct crtc *crtc = &dev->crtcs[i];
+		if (obj_state_changed(&crtc->prop_state, crtc->props.active) ||
+				obj_state_changed(&crtc->prop_state, crtc->props.mode_id)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// ALLOW_MODESET is dropped when the request doesn't change any connector or
+// CRTC mode, so that the kernel can't turn it into a full modeset
+static uint32_t strip_modeset(struct device *dev, uint32_t flags) {
+	if ((flags & DRM_MODE_ATOMIC_ALLOW_MODESET) && !pending_modeset(dev)) {
+		printf("current modes match, committing without modeset\n");
+		flags &= ~DRM_MODE_ATOMIC_ALLOW_MODESET;
+	}
+	return flags;
+}
+
+// Returns true if committing the current connector and CRTC configuration
+// requires ALLOW_MODESET. Otherwise, the first commit can be a page-flip which
+// replaces the framebuffers set up by the previous DRM master.
+bool device_needs_modeset(struct device *dev) {
+	for (size_t i = 0; i < dev->connectors_len; ++i) {
+		connector_update(&dev->connectors[i], NULL, false);
+	}
+	for (size_t i = 0; i < dev->crtcs_len; ++i) {
+		crtc_update(&dev->crtcs[i], NULL, false);
+	}
+
+	bool modeset = pending_modeset(dev);
+
+	for (size_t i = 0; i < dev->connectors_len; ++i) {
+		obj_state_discard(&dev->connectors[i].prop_state);
+	}
+	for (size_t i = 0; i < dev->crtcs_len; ++i) {
+		obj_state_discard(&dev->crtcs[i].prop_state);
+	}
+
+	return modeset;
+}
+
 void device_commit(struct device *dev, uint32_t flags) {
 	int cursor = drmModeAtomicGetCursor(dev->atomic_req);
+	bool full = flags & DRM_MODE_ATOMIC_ALLOW_MODESET;
+	for (size_t i = 0; i < dev->crtcs_len; ++i) {
+		full = full || dev->crtcs[i].full_commit;
+	}
 
 	for (size_t i = 0; i < dev->connectors_len; ++i) {
-		connector_update(&dev->connectors[i], dev->atomic_req);
+		connector_update(&dev->connectors[i], dev->atomic_req, full);
 	}
 
 	for (size_t i = 0; i < dev->crtcs_len; ++i) {
-		crtc_update(&dev->crtcs[i], dev->atomic_req);
+		crtc_update(&dev->crtcs[i], dev->atomic_req, full);
 	}
 
 	for (size_t i = 0; i < dev->planes_len; ++i) {
-		plane_update(&dev->planes[i], dev->atomic_req);
+		plane_update(&dev->planes[i], dev->atomic_req, full);
 	}
 
-	if (drmModeAtomicCommit(dev->fd, dev->atomic_req, flags, NULL)) {
+	flags = strip_modeset(dev, flags);
+
+	int ret = drmModeAtomicCommit(dev->fd, dev->atomic_req, flags, dev);
+	if (ret != 0) {
+		ret = -errno;
+	}
+	device_handle_commit(dev, flags, ret);
+	if (ret != 0) {
+		errno = -ret;
 		fatal_errno("drmModeAtomicCommit failed");
 	}
 
 	drmModeAtomicSetCursor(dev->atomic_req, cursor);
 }
+
+// Commits several CRTCs in a single atomic request. The device is passed as
+// the event user data, page-flip events are dispatched per CRTC. Returns 0 on
+// success, a negative errno value if the kernel rejected the commit.
+int device_try_commit_crtcs(struct device *dev, struct crtc **crtcs,
+		size_t crtcs_len, uint32_t flags) {
+	int cursor = drmModeAtomicGetCursor(dev->atomic_req);
+	bool modeset = flags & DRM_MODE_ATOMIC_ALLOW_MODESET;
+
+	for (size_t i = 0; i < crtcs_len; ++i) {
+		crtc_add_to_request(crtcs[i], dev->atomic_req,
+			crtcs[i]->full_commit || modeset, flags);
+	}
+	flags = strip_modeset(dev, flags);
+
+	int ret = drmModeAtomicCommit(dev->fd, dev->atomic_req, flags, dev);
+	if (ret != 0) {
+		ret = -errno;
+	}
+	device_handle_commit(dev, flags, ret);
+
+	if (ret == 0 && (flags & DRM_MODE_PAGE_FLIP_EVENT) &&
+			!(flags & DRM_MODE_ATOMIC_TEST_ONLY)) {
+		for (size_t i = 0; i < crtcs_len; ++i) {
+			frame_stats_submit(&crtcs[i]->stats);
+			crtcs[i]->flip_pending = true;
+			if (crtcs[i]->commit_handler != NULL) {
+				crtcs[i]->commit_handler(crtcs[i], 0, crtcs[i]->page_flip_data);
+			}
+		}
+	}
+	if (ret == 0 && !(flags & DRM_MODE_ATOMIC_TEST_ONLY)) {
+		// The cursor plane was part of the request
+		for (size_t i = 0; i < crtcs_len; ++i) {
+			crtcs[i]->cursor_requested = false;
+		}
+	}
+
+	drmModeAtomicSetCursor(dev->atomic_req, cursor);
+	return ret;
+}
+
+void device_commit_crtcs(struct device *dev, struct crtc **crtcs,
+		size_t crtcs_len, uint32_t flags) {
+	int ret = device_try_commit_crtcs(dev, crtcs, crtcs_len, flags);
+	if (ret != 0) {
+		errno = -ret;
+		fatal_errno("drmModeAtomicCommit failed");
+	}
+}
+
+// Busy CRTCs stay requested. Rejected commits are reported to the CRTC's
+// commit handler if it has one.
+static void handle_flush_failure(struct crtc *crtc, int ret) {
+	if (ret == 0) {
+		return;
+	} else if (ret == -EBUSY) {
+		crtc->commit_requested = true;
+		return;
+	}
+
+	if (crtc->commit_handler == NULL) {
+		errno = -ret;
+		fatal_errno("drmModeAtomicCommit failed");
+	}
+	crtc->commit_handler(crtc, ret, crtc->page_flip_data);
+}
+
+static void flush_crtcs(struct device *dev) {
+	uint32_t flags = DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_NONBLOCK;
+
+	struct crtc *crtcs[dev->crtcs_len + 1];
+	size_t crtcs_len = 0;
+	for (size_t i = 0; i < dev->crtcs_len; ++i) {
+		struct crtc *crtc = &dev->crtcs[i];
+		if (crtc->commit_requested && !crtc->flip_pending) {
+			crtcs[crtcs_len++] = crtc;
+			crtc->commit_requested = false;
+		}
+	}
+	if (crtcs_len == 0) {
+		return;
+	}
+
+	int ret = device_try_commit_crtcs(dev, crtcs, crtcs_len, flags);
+	if (ret != 0 && crtcs_len > 1) {
+		// Find out which CRTCs are busy or rejected, so that they don't
+		// delay the others
+		for (size_t i = 0; i < crtcs_len; ++i) {
+			ret = device_try_commit_crtcs(dev, &crtcs[i], 1, flags);
+			handle_flush_failure(crtcs[i], ret);
+		}
+	} else {
+		handle_flush_failure(crtcs[0], ret);
+	}
+}
+
+// Sends the requested commits of all CRTCs without a pending page-flip. CRTCs
+// which became ready at the same time share a single atomic request, the
+// others don't hold them back. CRTCs which turn out to be busy stay requested.
+// Cursor updates not merged into these commits are sent on their own.
+void device_flush(struct device *dev) {
+	flush_crtcs(dev);
+
+	for (size_t i = 0; i < dev->crtcs_len; ++i) {
+		struct crtc *crtc = &dev->crtcs[i];
+		if (!crtc->cursor_requested || crtc->flip_pending ||
+				crtc->commit_requested) {
+			continue;
+		}
+
+		crtc->cursor_requested = false;
+		int ret = cursor_commit(crtc->cursor);
+		if (ret == -EBUSY) {
+			crtc->cursor_requested = true;
+		} else if (ret != 0) {
+			errno = -ret;
+			fatal_errno("drmModeAtomicCommit failed");
+		}
+	}
+}
+
+static void handle_obj_commit(struct obj_state *state, bool apply) {
+	if (apply) {
+		obj_state_apply(state);
+	} else {
+		obj_state_discard(state);
+	}
+}
+
+// Must be called after each commit of a request built with *_update, with 0
+// or the negative errno value of the failed commit
+void device_handle_commit(struct device *dev, uint32_t flags, int ret) {
+	bool apply = ret == 0 && !(flags & DRM_MODE_ATOMIC_TEST_ONLY);
+
+	// Don't trust our view of the kernel state after a failure. A rejected
+	// TEST_ONLY commit and EBUSY leave the kernel state untouched. Only the
+	// CRTCs in the request, directly or through one of their planes, are
+	// affected.
+	if (ret != 0 && ret != -EBUSY && !(flags & DRM_MODE_ATOMIC_TEST_ONLY)) {
+		for (size_t i = 0; i < dev->crtcs_len; ++i) {
+			struct crtc *crtc = &dev->crtcs[i];
+			if (crtc->prop_state.pending_mask != 0) {
+				crtc->full_commit = true;
+			}
+		}
+		for (size_t i = 0; i < dev->planes_len; ++i) {
+			struct plane *plane = &dev->planes[i];
+			if (plane->prop_state.pending_mask != 0 && plane->crtc != NULL) {
+				plane->crtc->full_commit = true;
+			}
+		}
+	}
+
+	for (size_t i = 0; i < dev->connectors_len; ++i) {
+		handle_obj_commit(&dev->connectors[i].prop_state, apply);
+	}
+
+	for (size_t i = 0; i < dev->crtcs_len; ++i) {
+		struct crtc *crtc = &dev->crtcs[i];
+		// The CRTC properties are only missing from cursor-only requests.
+		// Otherwise the connectors and planes of the CRTC were added too.
+		if (apply && crtc->prop_state.pending_mask != 0) {
+			crtc->full_commit = false;
+		}
+		handle_obj_commit(&crtc->prop_state, apply);
+	}
+
+	for (size_t i = 0; i < dev->planes_len; ++i) {
+		struct plane *plane = &dev->planes[i];
+		bool committed = apply && plane->prop_state.pending_mask != 0;
+		handle_obj_commit(&plane->prop_state, apply);
+		if (committed) {
+			plane->damage_len = 0;
+		}
+	}
+}
@@ -1,6 +1,7 @@
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "dp_drm.h"
 #include "util.h"
@@ -36,6 +37,7 @@ void plane_init(struct plane *plane, struct device *dev, uint32_t plane_id) {
 		{ "CRTC_W", &plane->props.crtc_w, NULL, true },
 		{ "CRTC_X", &plane->props.crtc_x, NULL, true },
 		{ "CRTC_Y", &plane->props.crtc_y, NULL, true },
+		{ "FB_DAMAGE_CLIPS", &plane->props.fb_damage_clips, NULL, false },
 		{ "FB_ID", &plane->props.fb_id, NULL, true },
 		{ "SRC_H", &plane->props.src_h, NULL, true },
 		{ "SRC_W", &plane->props.src_w, NULL, true },
@@ -45,7 +47,7 @@ void plane_init(struct plane *plane, struct device *dev, uint32_t plane_id) {
 		{ "type", &plane->props.type, &plane->type, true },
 	};
 	read_obj_props(dev, plane_id, DRM_MODE_OBJECT_PLANE, plane_props,
-		sizeof(plane_props) / sizeof(plane_props[0]));
+		sizeof(plane_props) / sizeof(plane_props[0]), &plane->snapshot);
 
 	plane->crtc = device_find_crtc(dev, crtc_id);
 
@@ -53,6 +55,11 @@ void plane_init(struct plane *plane, struct device *dev, uint32_t plane_id) {
 }
 
 void plane_finish(struct plane *plane) {
+	if (plane->damage_blob_id != 0) {
+		drmModeDestroyPropertyBlob(plane->dev->fd, plane->damage_blob_id);
+	}
+	free(plane->damage_blob_rects);
+	free(plane->damage);
 	free(plane->linear_formats);
 }
 
@@ -61,10 +68,8 @@ void plane_set_framebuffer(struct plane *plane, struct framebuffer *fb) {
 		return;
 	}
 
+	// Not logged, swapchains assign a new framebuffer on each frame
 	plane->fb = fb;
-
-	printf("assigning framebuffer %"PRIu32" to plane %"PRIu32"\n",
-		fb->id, plane->id);
 }
 
 bool plane_set_crtc(struct plane *plane, struct crtc *crtc) {
@@ -91,30 +96,99 @@ bool plane_set_crtc(struct plane *plane, struct crtc *crtc) {
 	return true;
 }
 
-void plane_update(struct plane *plane, drmModeAtomicReq *req) {
+// Marks a region of the framebuffer as changed since the last commit
+void plane_add_damage(struct plane *plane, const struct rect *rect) {
+	if (plane->fb == NULL) {
+		return;
+	}
+
+	// Clip to the framebuffer
+	uint32_t x2 = rect->x + rect->width, y2 = rect->y + rect->height;
+	if (x2 > plane->fb->width) {
+		x2 = plane->fb->width;
+	}
+	if (y2 > plane->fb->height) {
+		y2 = plane->fb->height;
+	}
+	if (rect->x >= x2 || rect->y >= y2) {
+		return;
+	}
+
+	if (plane->damage_len == plane->damage_cap) {
+		plane->damage_cap = plane->damage_cap ? 2 * plane->damage_cap : 4;
+		plane->damage = xrealloc(plane->damage,
+			plane->damage_cap * sizeof(struct drm_mode_rect));
+	}
+	plane->damage[plane->damage_len++] = (struct drm_mode_rect){
+		.x1 = rect->x,
+		.y1 = rect->y,
+		.x2 = x2,
+		.y2 = y2,
+	};
+}
+
+// Damage changes nearly every frame, so it doesn't go through the device blob
+// cache where it would evict blobs worth keeping, like MODE_ID ones
+static uint32_t damage_blob(struct plane *plane) {
+	size_t size = plane->damage_len * sizeof(struct drm_mode_rect);
+	if (plane->damage_blob_id != 0 &&
+			plane->damage_blob_len == plane->damage_len &&
+			memcmp(plane->damage_blob_rects, plane->damage, size) == 0) {
+		return plane->damage_blob_id;
+	}
+
+	// The kernel keeps its own reference to blobs in use by a commit
+	if (plane->damage_blob_id != 0) {
+		drmModeDestroyPropertyBlob(plane->dev->fd, plane->damage_blob_id);
+		plane->damage_blob_id = 0;
+	}
+
+	if (drmModeCreatePropertyBlob(plane->dev->fd, plane->damage, size,
+			&plane->damage_blob_id)) {
+		fatal_errno("failed to create FB_DAMAGE_CLIPS blob");
+	}
+
+	plane->damage_blob_rects = xrealloc(plane->damage_blob_rects, size);
+	memcpy(plane->damage_blob_rects, plane->damage, size);
+	plane->damage_blob_len = plane->damage_len;
+
+	return plane->damage_blob_id;
+}
+
+void plane_update(struct plane *plane, drmModeAtomicReq *req, bool full) {
+	struct obj_state *state = &plane->prop_state;
+
 	uint32_t crtc_id = 0;
 	uint32_t fb_id = 0;
 	if (plane->crtc != NULL && plane->fb != NULL) {
 		crtc_id = plane->crtc->id;
 		fb_id = plane->fb->id;
 	}
-	drmModeAtomicAddProperty(req, plane->id, plane->props.crtc_id, crtc_id);
-	drmModeAtomicAddProperty(req, plane->id, plane->props.fb_id, fb_id);
+	obj_state_add(state, req, plane->id, plane->props.crtc_id, crtc_id, full);
+	obj_state_add(state, req, plane->id, plane->props.fb_id, fb_id, full);
 
 	if (plane->crtc != NULL && plane->fb != NULL) {
-		drmModeAtomicAddProperty(req, plane->id, plane->props.crtc_x, plane->x);
-		drmModeAtomicAddProperty(req, plane->id, plane->props.crtc_y, plane->y);
-		drmModeAtomicAddProperty(req, plane->id, plane->props.crtc_w, plane->width);
-		drmModeAtomicAddProperty(req, plane->id, plane->props.crtc_h, plane->height);
+		obj_state_add(state, req, plane->id, plane->props.crtc_x, plane->x, full);
+		obj_state_add(state, req, plane->id, plane->props.crtc_y, plane->y, full);
+		obj_state_add(state, req, plane->id, plane->props.crtc_w, plane->width, full);
+		obj_state_add(state, req, plane->id, plane->props.crtc_h, plane->height, full);
 
 		// The src_* properties are in 16.16 fixed point
-		drmModeAtomicAddProperty(req, plane->id, plane->props.src_x, 0);
-		drmModeAtomicAddProperty(req, plane->id, plane->props.src_y, 0);
-		drmModeAtomicAddProperty(req, plane->id, plane->props.src_w, plane->fb->width << 16);
-		drmModeAtomicAddProperty(req, plane->id, plane->props.src_h, plane->fb->height << 16);
+		obj_state_add(state, req, plane->id, plane->props.src_x, 0, full);
+		obj_state_add(state, req, plane->id, plane->props.src_y, 0, full);
+		obj_state_add(state, req, plane->id, plane->props.src_w, plane->fb->width << 16, full);
+		obj_state_add(state, req, plane->id, plane->props.src_h, plane->fb->height << 16, full);
 
 		if (plane->props.alpha) {
-			drmModeAtomicAddProperty(req, plane->id, plane->props.alpha, plane->alpha * 0xFFFF);
+			obj_state_add(state, req, plane->id, plane->props.alpha, plane->alpha * 0xFFFF, full);
+		}
+
+		// Damage isn't part of the kernel's plane state, it needs to be set on
+		// each commit. Commit plans don't have a request and always send full
+		// damage.
+		if (plane->props.fb_damage_clips && plane->damage_len > 0 && req) {
+			drmModeAtomicAddProperty(req, plane->id,
+				plane->props.fb_damage_clips, damage_blob(plane));
 		}
 	}
 }
@@ -0,0 +1,462 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "dp_drm.h"
+#include "util.h"
+
+// Upper bound on the number of TEST_ONLY commits per search, not counting the
+// all-composited fallback
+#define MAX_TESTS_PER_SEARCH 16
+
+struct saved_plane {
+	struct crtc *crtc;
+	struct framebuffer *fb;
+	uint32_t x, y, width, height;
+	float alpha;
+};
+
+struct search {
+	struct plane_alloc *alloc;
+	struct layer *layers;
+	size_t layers_len;
+	struct framebuffer *composite;
+
+	// Overlay planes first, then cursor planes. Layers are assigned to planes
+	// in this order, so that the stacking order is preserved.
+	struct plane **candidates;
+	size_t candidates_len;
+	struct saved_plane *saved; // primary first, then candidates
+
+	struct plane_alloc_key key;
+	uint64_t hash; // of key
+	size_t tests_left;
+	struct plane_alloc_result result;
+};
+
+void plane_alloc_init(struct plane_alloc *alloc, struct crtc *crtc) {
+	struct device *dev = crtc->dev;
+	size_t crtc_idx = crtc - dev->crtcs;
+
+	memset(alloc, 0, sizeof(*alloc));
+	alloc->crtc = crtc;
+
+	for (size_t i = 0; i < dev->planes_len; ++i) {
+		struct plane *plane = &dev->planes[i];
+		if (plane->type != DRM_PLANE_TYPE_PRIMARY ||
+				(plane->possible_crtcs & (1 << crtc_idx)) == 0) {
+			continue;
+		}
+		if (plane->crtc == crtc ||
+				(plane->crtc == NULL && alloc->primary == NULL)) {
+			alloc->primary = plane;
+		}
+	}
+	if (alloc->primary == NULL) {
+		fatal("no primary plane for CRTC %"PRIu32, crtc->id);
+	}
+	alloc->primary->crtc = crtc;
+}
+
+// Planes used by the allocator stay assigned to the CRTC
+void plane_alloc_finish(struct plane_alloc *alloc) {
+	printf("plane allocator for CRTC %"PRIu32": %"PRIu64" assignments, "
+		"%"PRIu64" searches, %"PRIu64" TEST_ONLY commits\n", alloc->crtc->id,
+		alloc->assigns, alloc->searches, alloc->test_commits);
+}
+
+static uint64_t hash_u32(uint64_t hash, uint32_t v) {
+	// FNV-1a
+	for (size_t i = 0; i < 4; ++i) {
+		hash ^= (v >> (8 * i)) & 0xFF;
+		hash *= 0x100000001B3;
+	}
+	return hash;
+}
+
+// Positions aren't part of the key, otherwise moving layers would never hit
+// the cache. Drivers may still reject a plane because of its position, e.g.
+// alignment or overlap constraints, so cached results are tested again before
+// being used, see plane_alloc_assign.
+static void fill_key(struct search *s) {
+	struct plane_alloc_key *key = &s->key;
+	const drmModeModeInfo *mode = s->alloc->crtc->mode;
+
+	memset(key, 0, sizeof(*key));
+	if (mode != NULL) {
+		key->mode_width = mode->hdisplay;
+		key->mode_height = mode->vdisplay;
+	}
+	key->composite_format = s->composite->format;
+	key->composite_width = s->composite->width;
+	key->composite_height = s->composite->height;
+
+	key->layers_len = s->layers_len;
+	for (size_t i = 0; i < s->layers_len; ++i) {
+		const struct layer *layer = &s->layers[i];
+		key->layers[i].format = layer->fb->format;
+		key->layers[i].fb_width = layer->fb->width;
+		key->layers[i].fb_height = layer->fb->height;
+		key->layers[i].width = layer->width;
+		key->layers[i].height = layer->height;
+		key->layers[i].translucent = layer->alpha < 1;
+		key->layers[i].inside = mode != NULL &&
+			layer->x + layer->width <= mode->hdisplay &&
+			layer->y + layer->height <= mode->vdisplay;
+	}
+
+	key->candidates_len = s->candidates_len;
+	for (size_t i = 0; i < s->candidates_len; ++i) {
+		key->candidates[i] = s->candidates[i]->id;
+	}
+
+	uint64_t hash = 0xCBF29CE484222325;
+	const uint8_t *bytes = (const uint8_t *)key;
+	for (size_t i = 0; i < sizeof(*key); ++i) {
+		hash ^= bytes[i];
+		hash *= 0x100000001B3;
+	}
+	s->hash = hash;
+}
+
+static uint64_t config_key(const struct plane_alloc_result *result) {
+	uint64_t hash = hash_u32(result->hash, result->composited);
+	for (size_t i = 0; i < result->key.layers_len; ++i) {
+		struct plane *plane = result->planes[i];
+		hash = hash_u32(hash, plane != NULL ? plane->id : 0);
+	}
+	return hash;
+}
+
+static bool plane_supports(const struct plane *plane, const struct layer *layer) {
+	bool format = false;
+	for (size_t i = 0; i < plane->linear_formats_len; ++i) {
+		if (plane->linear_formats[i] == layer->fb->format) {
+			format = true;
+			break;
+		}
+	}
+	if (!format) {
+		return false;
+	}
+
+	if (layer->alpha < 1 && plane->props.alpha == 0) {
+		return false;
+	}
+
+	// Cursor planes can't scale
+	if (plane->type == DRM_PLANE_TYPE_CURSOR &&
+			(layer->width != layer->fb->width ||
+			layer->height != layer->fb->height)) {
+		return false;
+	}
+
+	return true;
+}
+
+static void save_plane(struct saved_plane *saved, const struct plane *plane) {
+	saved->crtc = plane->crtc;
+	saved->fb = plane->fb;
+	saved->x = plane->x;
+	saved->y = plane->y;
+	saved->width = plane->width;
+	saved->height = plane->height;
+	saved->alpha = plane->alpha;
+}
+
+static void restore_plane(struct plane *plane, const struct saved_plane *saved) {
+	plane->crtc = saved->crtc;
+	plane->fb = saved->fb;
+	plane->x = saved->x;
+	plane->y = saved->y;
+	plane->width = saved->width;
+	plane->height = saved->height;
+	plane->alpha = saved->alpha;
+}
+
+static void restore(struct search *s) {
+	restore_plane(s->alloc->primary, &s->saved[0]);
+	for (size_t i = 0; i < s->candidates_len; ++i) {
+		restore_plane(s->candidates[i], &s->saved[i + 1]);
+	}
+}
+
+static void set_layer(struct plane *plane, struct crtc *crtc,
+		const struct layer *layer) {
+	plane->crtc = crtc;
+	plane->fb = layer->fb;
+	plane->x = layer->x;
+	plane->y = layer->y;
+	plane->width = layer->width;
+	plane->height = layer->height;
+	plane->alpha = layer->alpha;
+}
+
+static void apply(struct search *s, const struct plane_alloc_result *result) {
+	struct plane_alloc *alloc = s->alloc;
+	struct crtc *crtc = alloc->crtc;
+
+	// Planes previously used by the CRTC need to be disabled
+	for (size_t i = 0; i < s->candidates_len; ++i) {
+		struct plane *plane = s->candidates[i];
+		if (plane->crtc == crtc) {
+			plane->fb = NULL;
+		}
+	}
+
+	if (result->composited == 0) {
+		set_layer(alloc->primary, crtc, &s->layers[0]);
+	} else {
+		struct layer layer = {
+			.fb = s->composite,
+			.width = s->composite->width,
+			.height = s->composite->height,
+			.alpha = 1,
+		};
+		set_layer(alloc->primary, crtc, &layer);
+	}
+
+	for (size_t i = 0; i < s->layers_len; ++i) {
+		struct plane *plane = result->planes[i];
+		if (plane != NULL && plane != alloc->primary) {
+			set_layer(plane, crtc, &s->layers[i]);
+		}
+	}
+}
+
+static bool is_rejected(struct plane_alloc *alloc, uint64_t key) {
+	for (size_t i = 0; i < alloc->rejected_len; ++i) {
+		if (alloc->rejected[i] == key) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void add_rejected(struct plane_alloc *alloc, uint64_t key) {
+	size_t cap = sizeof(alloc->rejected) / sizeof(alloc->rejected[0]);
+	alloc->rejected[alloc->rejected_next] = key;
+	alloc->rejected_next = (alloc->rejected_next + 1) % cap;
+	if (alloc->rejected_len < cap) {
+		++alloc->rejected_len;
+	}
+}
+
+// Applies the configuration in s->result if the kernel accepts it. Only
+// rejections are remembered: a hash collision may make us skip a working
+// configuration, but never apply an untested one.
+static bool try_config(struct search *s, bool fallback) {
+	struct plane_alloc *alloc = s->alloc;
+
+	uint64_t key = config_key(&s->result);
+	if (!fallback && is_rejected(alloc, key)) {
+		return false;
+	}
+
+	apply(s, &s->result);
+
+	if (s->tests_left == 0 && !fallback) {
+		restore(s);
+		return false;
+	} else if (s->tests_left > 0) {
+		--s->tests_left;
+	}
+
+	++alloc->test_commits;
+	bool ok = crtc_try_commit(alloc->crtc, DRM_MODE_ATOMIC_TEST_ONLY) == 0;
+	if (!ok) {
+		add_rejected(alloc, key);
+	}
+	if (!ok && !fallback) {
+		restore(s);
+	}
+	return ok;
+}
+
+static bool search_planes(struct search *s, size_t layer_idx,
+		size_t candidate_idx) {
+	if (layer_idx == s->layers_len) {
+		return try_config(s, false);
+	}
+
+	size_t layers_left = s->layers_len - layer_idx;
+	for (size_t i = candidate_idx;
+			i + layers_left <= s->candidates_len; ++i) {
+		struct plane *plane = s->candidates[i];
+		if (!plane_supports(plane, &s->layers[layer_idx])) {
+			continue;
+		}
+
+		s->result.planes[layer_idx] = plane;
+		if (search_planes(s, layer_idx + 1, i + 1)) {
+			return true;
+		}
+	}
+
+	s->result.planes[layer_idx] = NULL;
+	return false;
+}
+
+static void reset_result(struct search *s, size_t composited) {
+	memset(&s->result, 0, sizeof(s->result));
+	s->result.valid = true;
+	s->result.hash = s->hash;
+	s->result.key = s->key;
+	s->result.composited = composited;
+}
+
+// Composites as few bottom layers as possible
+static void search(struct search *s) {
+	struct plane_alloc *alloc = s->alloc;
+
+	++alloc->searches;
+	s->tests_left = MAX_TESTS_PER_SEARCH;
+
+	for (size_t composited = 0; composited < s->layers_len; ++composited) {
+		reset_result(s, composited);
+
+		size_t first = composited;
+		if (composited == 0) {
+			if (!plane_supports(alloc->primary, &s->layers[0])) {
+				continue;
+			}
+			s->result.planes[0] = alloc->primary;
+			first = 1;
+		}
+
+		if (search_planes(s, first, 0)) {
+			return;
+		}
+	}
+
+	reset_result(s, s->layers_len);
+	if (!try_config(s, true)) {
+		printf("CRTC %"PRIu32" rejected the fully composited configuration\n",
+			alloc->crtc->id);
+	}
+}
+
+static struct plane_alloc_result *find_result(struct plane_alloc *alloc,
+		uint64_t hash, const struct plane_alloc_key *key) {
+	for (size_t i = 0; i < alloc->results_len; ++i) {
+		struct plane_alloc_result *result = &alloc->results[i];
+		if (result->valid && result->hash == hash &&
+				memcmp(&result->key, key, sizeof(*key)) == 0) {
+			return result;
+		}
+	}
+	return NULL;
+}
+
+static void add_result(struct plane_alloc *alloc,
+		const struct plane_alloc_result *result) {
+	size_t cap = sizeof(alloc->results) / sizeof(alloc->results[0]);
+	alloc->results[alloc->results_next] = *result;
+	alloc->results_next = (alloc->results_next + 1) % cap;
+	if (alloc->results_len < cap) {
+		++alloc->results_len;
+	}
+}
+
+// Assigns layers, ordered from bottom to top, to the planes of the CRTC and
+// sets up the planes for the next commit. Returns the number of bottom layers
+// which couldn't be assigned to a plane: the caller needs to composite them
+// into the composite framebuffer, which is then displayed on the primary
+// plane. Only planes which aren't used by another CRTC, nor as the cursor of
+// this one, are considered.
+size_t plane_alloc_assign(struct plane_alloc *alloc, struct layer *layers,
+		size_t layers_len, struct framebuffer *composite) {
+	struct crtc *crtc = alloc->crtc;
+	struct device *dev = crtc->dev;
+	size_t crtc_idx = crtc - dev->crtcs;
+
+	if (layers_len == 0 || layers_len > PLANE_ALLOC_MAX_LAYERS) {
+		fatal("unsupported number of layers: %zu", layers_len);
+	}
+
+	struct plane *candidates[PLANE_ALLOC_MAX_CANDIDATES];
+	size_t candidates_len = 0;
+	uint32_t types[] = { DRM_PLANE_TYPE_OVERLAY, DRM_PLANE_TYPE_CURSOR };
+	for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); ++i) {
+		for (size_t j = 0; j < dev->planes_len; ++j) {
+			struct plane *plane = &dev->planes[j];
+			if (plane->type != types[i] ||
+					(plane->possible_crtcs & (1 << crtc_idx)) == 0 ||
+					(plane->crtc != NULL && plane->crtc != crtc) ||
+					(crtc->cursor != NULL && crtc->cursor->plane == plane)) {
+				continue;
+			}
+			if (candidates_len == PLANE_ALLOC_MAX_CANDIDATES) {
+				break;
+			}
+			candidates[candidates_len++] = plane;
+		}
+	}
+
+	struct saved_plane saved[candidates_len + 1];
+	save_plane(&saved[0], alloc->primary);
+	for (size_t i = 0; i < candidates_len; ++i) {
+		save_plane(&saved[i + 1], candidates[i]);
+	}
+
+	struct search s = {
+		.alloc = alloc,
+		.layers = layers,
+		.layers_len = layers_len,
+		.composite = composite,
+		.candidates = candidates,
+		.candidates_len = candidates_len,
+		.saved = saved,
+	};
+	fill_key(&s);
+
+	++alloc->assigns;
+	// A single TEST_ONLY commit is still much cheaper than a search
+	struct plane_alloc_result *cached = find_result(alloc, s.hash, &s.key);
+	if (cached != NULL) {
+		s.result = *cached;
+		apply(&s, &s.result);
+		++alloc->test_commits;
+		if (crtc_try_commit(crtc, DRM_MODE_ATOMIC_TEST_ONLY) != 0) {
+			restore(&s);
+			cached->valid = false;
+			cached = NULL;
+		}
+	}
+	if (cached == NULL) {
+		search(&s);
+		add_result(alloc, &s.result);
+	}
+
+	// Damage is relative to the previous framebuffer of the plane, which
+	// belonged to another layer if the assignment changed
+	if (s.result.composited != alloc->current.composited ||
+			memcmp(s.result.planes, alloc->current.planes,
+			sizeof(s.result.planes)) != 0) {
+		alloc->primary->damage_len = 0;
+		for (size_t i = 0; i < candidates_len; ++i) {
+			candidates[i]->damage_len = 0;
+		}
+	}
+	alloc->current = s.result;
+
+	for (size_t i = 0; i < layers_len; ++i) {
+		layers[i].plane = s.result.planes[i];
+	}
+
+	return s.result.composited;
+}
+
+// Must be called when the kernel rejected a commit with the current
+// assignment, e.g. because a driver constraint didn't show up in TEST_ONLY
+// commits. The next plane_alloc_assign searches again instead of re-using it.
+void plane_alloc_handle_commit_failure(struct plane_alloc *alloc) {
+	struct plane_alloc_result *result = find_result(alloc,
+		alloc->current.hash, &alloc->current.key);
+	if (result != NULL) {
+		result->valid = false;
+	}
+	if (alloc->current.valid) {
+		add_rejected(alloc, config_key(&alloc->current));
+	}
+}
@@ -1,3 +1,4 @@
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,6 +6,90 @@
 #include "dp_drm.h"
 #include "util.h"
 
+static int prop_info_cmp(const void *arg1, const void *arg2) {
+	const uint32_t *key = arg1;
+	const struct prop_info *val = arg2;
+
+	if (*key < val->id) {
+		return -1;
+	}
+	return *key > val->id;
+}
+
+static struct prop_info *find_prop_info(struct device *dev, uint32_t prop_id) {
+	return bsearch(&prop_id, dev->prop_cache.entries,
+		dev->prop_cache.len, sizeof(struct prop_info), prop_info_cmp);
+}
+
+// The cache mutex must be held. On a miss, it's released while querying the
+// kernel, so that the ioctls of a parallel init aren't serialized.
+static const struct prop_info *lookup_prop_info(struct device *dev,
+		uint32_t prop_id) {
+	struct prop_info *info = find_prop_info(dev, prop_id);
+	if (info) {
+		++dev->prop_cache.hits;
+		return info;
+	}
+
+	pthread_mutex_unlock(&dev->prop_cache.mutex);
+	drmModePropertyRes *prop = drmModeGetProperty(dev->fd, prop_id);
+	if (!prop) {
+		fatal_errno("drmModeGetProperty failed");
+	}
+	pthread_mutex_lock(&dev->prop_cache.mutex);
+	++dev->prop_cache.misses;
+
+	// Another thread may have inserted it in the meantime
+	info = find_prop_info(dev, prop_id);
+	if (info) {
+		drmModeFreeProperty(prop);
+		return info;
+	}
+
+	if (dev->prop_cache.len == dev->prop_cache.cap) {
+		dev->prop_cache.cap = dev->prop_cache.cap ? 2 * dev->prop_cache.cap : 32;
+		dev->prop_cache.entries = xrealloc(dev->prop_cache.entries,
+			dev->prop_cache.cap * sizeof(struct prop_info));
+	}
+
+	// Keep the array sorted
+	size_t idx = 0;
+	while (idx < dev->prop_cache.len &&
+			dev->prop_cache.entries[idx].id < prop_id) {
+		++idx;
+	}
+	info = &dev->prop_cache.entries[idx];
+	memmove(info + 1, info,
+		(dev->prop_cache.len - idx) * sizeof(struct prop_info));
+	++dev->prop_cache.len;
+
+	*info = (struct prop_info){
+		.id = prop->prop_id,
+		.flags = prop->flags,
+	};
+	memcpy(info->name, prop->name, sizeof(info->name));
+	info->name[sizeof(info->name) - 1] = '\0';
+
+	if (prop->count_enums > 0) {
+		size_t enums_size =
+			prop->count_enums * sizeof(struct drm_mode_property_enum);
+		info->enums = xalloc(enums_size);
+		memcpy(info->enums, prop->enums, enums_size);
+		info->enums_len = prop->count_enums;
+	}
+
+	drmModeFreeProperty(prop);
+	return info;
+}
+
+void device_prop_cache_finish(struct device *dev) {
+	for (size_t i = 0; i < dev->prop_cache.len; ++i) {
+		free(dev->prop_cache.entries[i].enums);
+	}
+	free(dev->prop_cache.entries);
+	pthread_mutex_destroy(&dev->prop_cache.mutex);
+}
+
 static int prop_cmp(const void *arg1, const void *arg2) {
 	const char *key = arg1;
 	const struct prop *val = arg2;
@@ -12,34 +97,76 @@ static int prop_cmp(const void *arg1, const void *arg2) {
 	return strcmp(key, val->name);
 }
 
+// Legacy-only properties are rejected by atomic commits
+static bool is_restorable(const struct prop_info *info) {
+	return !(info->flags & DRM_MODE_PROP_IMMUTABLE) &&
+		strcmp(info->name, "DPMS") != 0;
+}
+
+static void snapshot_add(struct device *dev, struct obj_snapshot *snapshot,
+		uint32_t prop_id, uint64_t value, bool blob) {
+	struct saved_prop *prop = &snapshot->props[snapshot->len++];
+	*prop = (struct saved_prop){ .prop_id = prop_id, .value = value };
+	if (!blob || value == 0) {
+		return;
+	}
+
+	drmModePropertyBlobRes *res = drmModeGetPropertyBlob(dev->fd, value);
+	if (res == NULL) {
+		fatal_errno("failed to get blob %"PRIu64, value);
+	}
+	prop->blob_size = res->length;
+	prop->blob_data = xalloc(res->length);
+	memcpy(prop->blob_data, res->data, res->length);
+	drmModeFreePropertyBlob(res);
+}
+
+void obj_snapshot_finish(struct obj_snapshot *snapshot) {
+	for (size_t i = 0; i < snapshot->len; ++i) {
+		free(snapshot->props[i].blob_data);
+	}
+	free(snapshot->props);
+	snapshot->props = NULL;
+	snapshot->len = 0;
+}
+
+// Also saves the current values of all writable properties into snapshot
 void read_obj_props(struct device *dev, uint32_t obj_id, uint32_t obj_type,
-		struct prop *props, size_t props_len) {
+		struct prop *props, size_t props_len, struct obj_snapshot *snapshot) {
 	drmModeObjectProperties *obj_props =
 		drmModeObjectGetProperties(dev->fd, obj_id, obj_type);
 	if (!obj_props) {
 		fatal_errno("drmModeObjectGetProperties failed");
 	}
 
+	snapshot->props = xalloc(obj_props->count_props * sizeof(struct saved_prop));
+	snapshot->len = 0;
+
 	bool seen[props_len + 1];
 	memset(seen, false, props_len);
 	for (uint32_t i = 0; i < obj_props->count_props; ++i) {
-		drmModePropertyRes *prop =
-			drmModeGetProperty(dev->fd, obj_props->props[i]);
-		if (!prop) {
-			fatal_errno("drmModeGetProperty failed");
+		// Other threads may insert entries once the lock is released
+		pthread_mutex_lock(&dev->prop_cache.mutex);
+		const struct prop_info *info =
+			lookup_prop_info(dev, obj_props->props[i]);
+		struct prop *p = bsearch(info->name, props, props_len,
+			sizeof(*props), prop_cmp);
+		bool restorable = is_restorable(info);
+		bool blob = info->flags & DRM_MODE_PROP_BLOB;
+		pthread_mutex_unlock(&dev->prop_cache.mutex);
+
+		if (restorable) {
+			snapshot_add(dev, snapshot, obj_props->props[i],
+				obj_props->prop_values[i], blob);
 		}
 
-		struct prop *p = bsearch(prop->name, props, props_len,
-			sizeof(*props), prop_cmp);
 		if (p) {
 			seen[p - props] = true;
-			*p->dest = prop->prop_id;
+			*p->dest = obj_props->props[i];
 			if (p->value) {
 				*p->value = obj_props->prop_values[i];
 			}
 		}
-
-		drmModeFreeProperty(prop);
 	}
 
 	for (size_t i = 0; i < props_len; ++i) {
@@ -50,3 +177,77 @@ void read_obj_props(struct device *dev, uint32_t obj_id, uint32_t obj_type,
 
 	drmModeFreeObjectProperties(obj_props);
 }
+
+static size_t obj_state_index(struct obj_state *state, uint32_t obj_id,
+		uint32_t prop_id) {
+	size_t i = 0;
+	while (i < state->len && state->prop_ids[i] != prop_id) {
+		++i;
+	}
+	if (i == state->len) {
+		if (state->len == OBJ_STATE_MAX_PROPS) {
+			fatal("too many properties on object %"PRIu32, obj_id);
+		}
+		state->prop_ids[i] = prop_id;
+		++state->len;
+	}
+	return i;
+}
+
+// Records a value read from the kernel as committed
+void obj_state_init_value(struct obj_state *state, uint32_t obj_id,
+		uint32_t prop_id, uint64_t value) {
+	size_t i = obj_state_index(state, obj_id, prop_id);
+	state->committed[i] = value;
+	state->committed_mask |= 1 << i;
+}
+
+// Returns true if the pending value differs from the committed one, or if the
+// committed value is unknown
+bool obj_state_changed(const struct obj_state *state, uint32_t prop_id) {
+	for (size_t i = 0; i < state->len; ++i) {
+		if (state->prop_ids[i] != prop_id) {
+			continue;
+		}
+		uint32_t bit = 1 << i;
+		return (state->pending_mask & bit) &&
+			(!(state->committed_mask & bit) ||
+			state->committed[i] != state->pending[i]);
+	}
+	return false;
+}
+
+void obj_state_add(struct obj_state *state, drmModeAtomicReq *req,
+		uint32_t obj_id, uint32_t prop_id, uint64_t value, bool full) {
+	size_t i = obj_state_index(state, obj_id, prop_id);
+
+	uint32_t bit = 1 << i;
+	state->pending[i] = value;
+	state->pending_mask |= bit;
+
+	bool dirty = !(state->committed_mask & bit) || state->committed[i] != value;
+	if (req != NULL && (full || dirty)) {
+		drmModeAtomicAddProperty(req, obj_id, prop_id, value);
+	}
+}
+
+void obj_state_apply(struct obj_state *state) {
+	for (size_t i = 0; i < state->len; ++i) {
+		if (state->pending_mask & (1 << i)) {
+			state->committed[i] = state->pending[i];
+		}
+	}
+	state->committed_mask |= state->pending_mask;
+	state->pending_mask = 0;
+}
+
+void obj_state_discard(struct obj_state *state) {
+	state->pending_mask = 0;
+}
+
+// Marks all values as unknown, e.g. after the kernel state was changed by
+// another request
+void obj_state_forget(struct obj_state *state) {
+	state->committed_mask = 0;
+	state->pending_mask = 0;
+}
@@ -0,0 +1,209 @@
+#include <inttypes.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include <xf86drm.h>
+
+#include "dp_drm.h"
+#include "util.h"
+
+void event_loop_init(struct event_loop *loop) {
+	loop->devices = NULL;
+	loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epoll_fd < 0) {
+		fatal_errno("epoll_create1 failed");
+	}
+}
+
+// All sources must have been removed
+void event_loop_finish(struct event_loop *loop) {
+	close(loop->epoll_fd);
+}
+
+static struct event_source *add_source(struct event_loop *loop,
+		enum event_source_type type, int fd, uint32_t events,
+		event_source_func func, void *data) {
+	struct event_source *source = xalloc(sizeof(*source));
+	source->loop = loop;
+	source->type = type;
+	source->fd = fd;
+	source->func = func;
+	source->data = data;
+
+	struct epoll_event ev = { .events = events, .data.ptr = source };
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+		fatal_errno("epoll_ctl failed");
+	}
+
+	return source;
+}
+
+// The FD is owned by the caller
+struct event_source *event_loop_add_fd(struct event_loop *loop, int fd,
+		uint32_t events, event_source_func func, void *data) {
+	return add_source(loop, EVENT_SOURCE_FD, fd, events, func, data);
+}
+
+// The timer is disarmed until event_source_timer_arm is called
+struct event_source *event_loop_add_timer(struct event_loop *loop,
+		event_source_func func, void *data) {
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0) {
+		fatal_errno("timerfd_create failed");
+	}
+	return add_source(loop, EVENT_SOURCE_TIMER, fd, EPOLLIN, func, data);
+}
+
+// User sources are triggered with event_source_signal, from any thread
+struct event_source *event_loop_add_user(struct event_loop *loop,
+		event_source_func func, void *data) {
+	int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd < 0) {
+		fatal_errno("eventfd failed");
+	}
+	return add_source(loop, EVENT_SOURCE_USER, fd, EPOLLIN, func, data);
+}
+
+// Page-flip events are dispatched to the CRTC's page_flip_handler
+struct event_source *event_loop_add_device(struct event_loop *loop,
+		struct device *dev) {
+	if (!dev->caps.crtc_in_vblank_event) {
+		fatal("DRM device must support DRM_CAP_CRTC_IN_VBLANK_EVENT");
+	}
+
+	struct event_source *source =
+		add_source(loop, EVENT_SOURCE_DEVICE, dev->fd, EPOLLIN, NULL, NULL);
+	source->dev = dev;
+	source->next_device = loop->devices;
+	loop->devices = source;
+	return source;
+}
+
+static void remove_device(struct event_source *source) {
+	struct event_source **link = &source->loop->devices;
+	while (*link != source) {
+		link = &(*link)->next_device;
+	}
+	*link = source->next_device;
+}
+
+void event_source_remove(struct event_source *source) {
+	epoll_ctl(source->loop->epoll_fd, EPOLL_CTL_DEL, source->fd, NULL);
+
+	switch (source->type) {
+	case EVENT_SOURCE_TIMER:
+	case EVENT_SOURCE_USER:
+		close(source->fd);
+		break;
+	case EVENT_SOURCE_DEVICE:
+		remove_device(source);
+		break;
+	case EVENT_SOURCE_FD:
+		break;
+	}
+
+	free(source);
+}
+
+// time_ns is an absolute CLOCK_MONOTONIC time, 0 disarms the timer
+void event_source_timer_arm(struct event_source *source, uint64_t time_ns) {
+	struct itimerspec spec = {
+		.it_value = {
+			.tv_sec = time_ns / 1000000000,
+			.tv_nsec = time_ns % 1000000000,
+		},
+	};
+	if (timerfd_settime(source->fd, TFD_TIMER_ABSTIME, &spec, NULL) != 0) {
+		fatal_errno("timerfd_settime failed");
+	}
+}
+
+void event_source_signal(struct event_source *source) {
+	uint64_t one = 1;
+	if (write(source->fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+		fatal_errno("failed to signal event source");
+	}
+}
+
+// The commit user data is always the device, see crtc_commit
+static void handle_page_flip(int fd, unsigned int sequence,
+		unsigned int tv_sec, unsigned int tv_usec, unsigned int crtc_id,
+		void *data) {
+	struct device *dev = data;
+
+	struct crtc *crtc = device_find_crtc(dev, crtc_id);
+	if (crtc == NULL) {
+		fatal("received page-flip event for unknown CRTC %u", crtc_id);
+	}
+
+	crtc_handle_page_flip(crtc, sequence, tv_sec, tv_usec);
+}
+
+static void dispatch_device(struct event_source *source) {
+	drmEventContext context = {
+		.version = 3,
+		.page_flip_handler2 = handle_page_flip,
+	};
+
+	// drmHandleEvent reads a single buffer, keep going until the FD is empty
+	while (true) {
+		if (drmHandleEvent(source->fd, &context) < 0) {
+			if (errno == EAGAIN) {
+				break;
+			}
+			fatal_errno("drmHandleEvent failed");
+		}
+	}
+}
+
+static void dispatch_source(struct event_source *source, uint32_t events) {
+	uint64_t count;
+
+	switch (source->type) {
+	case EVENT_SOURCE_DEVICE:
+		dispatch_device(source);
+		return;
+	case EVENT_SOURCE_TIMER:
+	case EVENT_SOURCE_USER:
+		if (read(source->fd, &count, sizeof(count)) < 0) {
+			if (errno == EAGAIN) {
+				return;
+			}
+			fatal_errno("failed to read event source");
+		}
+		break;
+	case EVENT_SOURCE_FD:
+		break;
+	}
+
+	source->func(source, events, source->data);
+}
+
+// Waits for events and dispatches all of them, then flushes the commits
+// requested by the handlers. Returns the number of sources dispatched, 0 on
+// timeout, a negative errno value if waiting failed.
+int event_loop_dispatch(struct event_loop *loop, int timeout_ms) {
+	struct epoll_event events[32];
+	int n = epoll_wait(loop->epoll_fd, events,
+		sizeof(events) / sizeof(events[0]), timeout_ms);
+	if (n < 0) {
+		if (errno == EINTR) {
+			return 0;
+		}
+		return -errno;
+	}
+
+	for (int i = 0; i < n; ++i) {
+		dispatch_source(events[i].data.ptr, events[i].events);
+	}
+
+	for (struct event_source *source = loop->devices; source != NULL;
+			source = source->next_device) {
+		device_flush(source->dev);
+	}
+
+	return n;
+}
@@ -1,6 +1,8 @@
+#define _DEFAULT_SOURCE // for MAP_POPULATE
 #include <inttypes.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <unistd.h>
@@ -9,6 +11,7 @@
 #include <xf86drm.h>
 
 #include "dp.h"
+#include "pixel.h"
 #include "util.h"
 
 void framebuffer_dumb_init(struct framebuffer_dumb *fb, struct device *dev,
@@ -41,9 +44,12 @@ void framebuffer_dumb_init(struct framebuffer_dumb *fb, struct device *dev,
 		fatal("DRM_IOCTL_MODE_CREATE_DUMB failed");
 	}
 
+	// The mapping and shadow state start out empty
+	memset(fb, 0, sizeof(*fb));
 	fb->fb.dev = dev;
 	fb->fb.width = width;
 	fb->fb.height = height;
+	fb->fb.format = fmt;
 	fb->stride = create.pitch;
 	fb->handle = create.handle;
 	fb->size = create.size;
@@ -57,8 +63,9 @@ void framebuffer_dumb_init(struct framebuffer_dumb *fb, struct device *dev,
 		fatal("drmModeAddFB2 failed");
 	}
 
+	// We're about to touch every page anyways
 	void *data = NULL;
-	framebuffer_dumb_map(fb, PROT_WRITE, &data);
+	framebuffer_dumb_map(fb, PROT_WRITE | FRAMEBUFFER_DUMB_MAP_POPULATE, &data);
 	memset(data, 0xFF, fb->size);
 	framebuffer_dumb_unmap(fb, data);
 
@@ -66,6 +73,16 @@ void framebuffer_dumb_init(struct framebuffer_dumb *fb, struct device *dev,
 }
 
 void framebuffer_dumb_finish(struct framebuffer_dumb *fb) {
+	if (fb->map_refs > 0) {
+		fatal("dumb framebuffer %"PRIu32" is still mapped", fb->fb.id);
+	}
+	if (fb->map_data != NULL) {
+		munmap(fb->map_data, fb->size);
+		fb->map_data = NULL;
+	}
+	free(fb->shadow);
+	fb->shadow = NULL;
+
 	drmModeRmFB(fb->fb.dev->fd, fb->fb.id);
 	fb->fb.id = 0;
 
@@ -73,23 +90,125 @@ void framebuffer_dumb_finish(struct framebuffer_dumb *fb) {
 	drmIoctl(fb->fb.dev->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
 }
 
+// The mapping is created on first use and kept around, so mapping again is
+// free. It's always readable and writable. If the shadow is enabled, the
+// shadow is returned instead.
 void framebuffer_dumb_map(struct framebuffer_dumb *fb, uint32_t flags,
 		void **data_ptr) {
-	struct drm_mode_map_dumb map = { .handle = fb->handle };
-	int ret = drmIoctl(fb->fb.dev->fd, DRM_IOCTL_MODE_MAP_DUMB, &map);
-	if (ret < 0) {
-		fatal("DRM_IOCTL_MODE_MAP_DUMB failed");
+	if (fb->map_data == NULL) {
+		if (fb->map_offset == 0) {
+			struct drm_mode_map_dumb map = { .handle = fb->handle };
+			int ret = drmIoctl(fb->fb.dev->fd, DRM_IOCTL_MODE_MAP_DUMB, &map);
+			if (ret < 0) {
+				fatal("DRM_IOCTL_MODE_MAP_DUMB failed");
+			}
+			fb->map_offset = map.offset;
+		}
+
+		int mmap_flags = MAP_SHARED;
+		if (flags & FRAMEBUFFER_DUMB_MAP_POPULATE) {
+			mmap_flags |= MAP_POPULATE;
+		}
+
+		void *data = mmap(NULL, fb->size, PROT_READ | PROT_WRITE, mmap_flags,
+			fb->fb.dev->fd, fb->map_offset);
+		if (data == MAP_FAILED) {
+			fatal_errno("mmap failed");
+		}
+		fb->map_data = data;
 	}
 
-	void *data = mmap(0, fb->size, PROT_READ | PROT_WRITE, MAP_SHARED,
-		fb->fb.dev->fd, map.offset);
-	if (!data) {
-		fatal("mmap failed");
+	++fb->map_refs;
+	if (flags & PROT_WRITE) {
+		fb->shadow_written = true;
 	}
-
-	*data_ptr = data;
+	*data_ptr = fb->shadow ? fb->shadow : fb->map_data;
 }
 
+// Flushes the shadow when the last reference is dropped, unless it has only
+// been mapped for reading
 void framebuffer_dumb_unmap(struct framebuffer_dumb *fb, void *data) {
-	munmap(data, fb->size);
+	void *expected = fb->shadow ? fb->shadow : fb->map_data;
+	if (fb->map_refs == 0 || data != expected) {
+		fatal("dumb framebuffer %"PRIu32" isn't mapped", fb->fb.id);
+	}
+	--fb->map_refs;
+
+	if (fb->map_refs == 0 && fb->shadow_written) {
+		framebuffer_dumb_flush(fb);
+	}
+}
+
+// Dumb buffers are usually mapped write-combined, so reading from the mapping
+// is very slow. With a shadow, rendering happens in cached memory and dirty
+// rows are copied to the mapping with streaming stores.
+void framebuffer_dumb_enable_shadow(struct framebuffer_dumb *fb) {
+	if (fb->shadow) {
+		return;
+	}
+	if (fb->map_refs > 0) {
+		fatal("cannot enable shadow while dumb framebuffer is mapped");
+	}
+
+	void *shadow = NULL;
+	if (posix_memalign(&shadow, 64, fb->size) != 0) {
+		fatal("failed to allocate shadow buffer");
+	}
+
+	void *data = NULL;
+	framebuffer_dumb_map(fb, PROT_READ, &data);
+	memcpy(shadow, data, fb->size);
+	framebuffer_dumb_unmap(fb, data);
+
+	fb->shadow = shadow;
+
+	printf("enabled shadow for dumb framebuffer %"PRIu32"\n", fb->fb.id);
+}
+
+// Marks rows as changed in the shadow. If no rows are marked when the shadow
+// is flushed, the whole buffer is copied.
+void framebuffer_dumb_damage_rows(struct framebuffer_dumb *fb, uint32_t y,
+		uint32_t height) {
+	if (!fb->shadow) {
+		return;
+	}
+
+	uint32_t y2 = y + height;
+	if (y2 > fb->fb.height) {
+		y2 = fb->fb.height;
+	}
+	if (y >= y2) {
+		return;
+	}
+
+	if (fb->shadow_dirty_y1 == fb->shadow_dirty_y2) {
+		fb->shadow_dirty_y1 = y;
+		fb->shadow_dirty_y2 = y2;
+		return;
+	}
+	if (y < fb->shadow_dirty_y1) {
+		fb->shadow_dirty_y1 = y;
+	}
+	if (y2 > fb->shadow_dirty_y2) {
+		fb->shadow_dirty_y2 = y2;
+	}
+}
+
+void framebuffer_dumb_flush(struct framebuffer_dumb *fb) {
+	if (!fb->shadow) {
+		return;
+	}
+
+	uint32_t y1 = fb->shadow_dirty_y1, y2 = fb->shadow_dirty_y2;
+	if (y1 == y2) {
+		y1 = 0;
+		y2 = fb->fb.height;
+	}
+
+	size_t offset = (size_t)fb->stride * y1;
+	pixel_copy_stream((uint8_t *)fb->map_data + offset, fb->stride,
+		(uint8_t *)fb->shadow + offset, fb->stride, fb->fb.width, y2 - y1);
+
+	fb->shadow_dirty_y1 = fb->shadow_dirty_y2 = 0;
+	fb->shadow_written = false;
 }
@@ -0,0 +1,99 @@
+#include <inttypes.h>
+#include <stdio.h>
+
+#include "dp.h"
+#include "util.h"
+
+static size_t histogram_bucket(uint64_t value) {
+	if (value < (1 << HISTOGRAM_SUB_BITS)) {
+		return value;
+	}
+
+	int exp = 63 - __builtin_clzll(value);
+	int shift = exp - HISTOGRAM_SUB_BITS;
+	size_t sub = (value >> shift) & ((1 << HISTOGRAM_SUB_BITS) - 1);
+	return ((size_t)(shift + 1) << HISTOGRAM_SUB_BITS) + sub;
+}
+
+// Returns the smallest value of the bucket
+static uint64_t histogram_bucket_value(size_t bucket) {
+	if (bucket < (1 << HISTOGRAM_SUB_BITS)) {
+		return bucket;
+	}
+
+	int shift = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+	uint64_t sub = bucket & ((1 << HISTOGRAM_SUB_BITS) - 1);
+	return ((1 << HISTOGRAM_SUB_BITS) + sub) << shift;
+}
+
+void histogram_add(struct histogram *hist, uint64_t value) {
+	++hist->counts[histogram_bucket(value)];
+	++hist->total;
+	if (value > hist->max) {
+		hist->max = value;
+	}
+}
+
+// percentile is in [0, 100]
+uint64_t histogram_percentile(const struct histogram *hist,
+		double percentile) {
+	if (hist->total == 0) {
+		return 0;
+	}
+
+	uint64_t rank = percentile / 100 * hist->total;
+	if (rank >= hist->total) {
+		return hist->max;
+	}
+
+	uint64_t seen = 0;
+	for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+		seen += hist->counts[i];
+		if (seen > rank) {
+			return histogram_bucket_value(i);
+		}
+	}
+	return hist->max;
+}
+
+void frame_stats_submit(struct frame_stats *stats) {
+	stats->submit_ns = now_ns();
+}
+
+// flip_ns is the CLOCK_MONOTONIC timestamp of the page-flip event
+void frame_stats_page_flip(struct frame_stats *stats, unsigned int sequence,
+		uint64_t flip_ns) {
+	if (stats->submit_ns != 0 && flip_ns > stats->submit_ns) {
+		histogram_add(&stats->latency_us, (flip_ns - stats->submit_ns) / 1000);
+	}
+	stats->submit_ns = 0;
+
+	if (stats->last_flip_ns != 0) {
+		histogram_add(&stats->interval_us,
+			(flip_ns - stats->last_flip_ns) / 1000);
+
+		unsigned int delta = sequence - stats->last_sequence;
+		if (delta > 1) {
+			stats->missed_vblanks += delta - 1;
+		}
+	}
+	stats->last_flip_ns = flip_ns;
+	stats->last_sequence = sequence;
+
+	++stats->frames;
+}
+
+static void print_histogram(const char *name, const struct histogram *hist) {
+	printf("  %s: p50 %"PRIu64" us, p90 %"PRIu64" us, p99 %"PRIu64" us, "
+		"p99.9 %"PRIu64" us, max %"PRIu64" us\n", name,
+		histogram_percentile(hist, 50), histogram_percentile(hist, 90),
+		histogram_percentile(hist, 99), histogram_percentile(hist, 99.9),
+		hist->max);
+}
+
+void frame_stats_print(const struct frame_stats *stats, uint32_t crtc_id) {
+	printf("CRTC %"PRIu32": %"PRIu64" frames, %"PRIu64" missed vblanks\n",
+		crtc_id, stats->frames, stats->missed_vblanks);
+	print_histogram("flip latency", &stats->latency_us);
+	print_histogram("flip interval", &stats->interval_us);
+}
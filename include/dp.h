@@ -1,6 +1,7 @@
 #ifndef DP_H
 #define DP_H
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <sys/types.h>
@@ -10,11 +11,51 @@
 
 struct device;
 struct connector;
+struct cursor;
+struct event_loop;
+struct thread_pool;
+struct prop_info;
+struct blob_entry;
+
+#define OBJ_STATE_MAX_PROPS 16
+
+// Property values of a KMS object, used to only emit the properties which
+// changed since the last successful commit
+struct obj_state {
+	size_t len;
+	uint32_t prop_ids[OBJ_STATE_MAX_PROPS];
+	uint64_t committed[OBJ_STATE_MAX_PROPS];
+	uint64_t pending[OBJ_STATE_MAX_PROPS];
+	uint32_t committed_mask; // values known to be applied by the kernel
+	uint32_t pending_mask; // values set in the request being built
+};
+
+struct saved_prop {
+	uint32_t prop_id;
+	uint64_t value;
+
+	// Contents of blob properties, the blob may be gone by the time the state
+	// is restored
+	void *blob_data;
+	size_t blob_size;
+};
+
+// Property values of a KMS object found at init, see device_restore
+struct obj_snapshot {
+	struct saved_prop *props;
+	size_t len;
+};
+
+struct rect {
+	uint32_t x, y;
+	uint32_t width, height;
+};
 
 struct framebuffer {
 	struct device *dev;
 	uint32_t id;
 	uint32_t width, height;
+	uint32_t format;
 };
 
 struct framebuffer_dumb {
@@ -23,6 +64,52 @@ struct framebuffer_dumb {
 	uint32_t stride;
 	uint32_t handle; // driver-specific handle
 	uint64_t size; // size of mapping
+
+	// CPU mapping, kept until the framebuffer is destroyed
+	void *map_data; // NULL if not mapped yet
+	size_t map_refs;
+	uint64_t map_offset; // 0 if unknown
+
+	// Number of frames since the contents were queued, 0 if undefined. Set by
+	// swapchains.
+	uint32_t age;
+
+	// Cached system memory copy, see framebuffer_dumb_enable_shadow
+	void *shadow; // NULL if disabled
+	uint32_t shadow_dirty_y1, shadow_dirty_y2; // rows to flush, [y1, y2)
+	bool shadow_written; // mapped with PROT_WRITE since the last flush
+};
+
+// Prefault the mapping, on top of the PROT_* flags
+#define FRAMEBUFFER_DUMB_MAP_POPULATE (1u << 31)
+
+enum swapchain_buffer_state {
+	SWAPCHAIN_BUFFER_FREE,
+	SWAPCHAIN_BUFFER_ACQUIRED, // being rendered to
+	SWAPCHAIN_BUFFER_QUEUED, // assigned to the plane, not committed yet
+	SWAPCHAIN_BUFFER_COMMITTED, // committed, waiting for a page-flip
+	SWAPCHAIN_BUFFER_SCANOUT, // being displayed
+};
+
+struct swapchain_buffer {
+	struct framebuffer_dumb fb;
+	enum swapchain_buffer_state state;
+};
+
+#define SWAPCHAIN_DAMAGE_HISTORY 4
+
+// A set of dumb framebuffers cycled through for a plane
+struct swapchain {
+	struct plane *plane; // can be NULL
+
+	size_t buffers_len;
+	struct swapchain_buffer *buffers;
+
+	struct rect damage; // bounding box of the damage of the current frame
+
+	// Ring of the damage of previously queued frames
+	struct rect damage_history[SWAPCHAIN_DAMAGE_HISTORY];
+	size_t damage_history_head, damage_history_len;
 };
 
 struct plane {
@@ -47,6 +134,7 @@ struct plane {
 		uint32_t crtc_w;
 		uint32_t crtc_x;
 		uint32_t crtc_y;
+		uint32_t fb_damage_clips; // optional
 		uint32_t fb_id;
 		uint32_t src_h;
 		uint32_t src_w;
@@ -54,13 +142,49 @@ struct plane {
 		uint32_t src_y;
 		uint32_t type;
 	} props;
+
+	struct obj_state prop_state;
+	struct obj_snapshot snapshot;
+
+	// Damage in framebuffer coordinates, reset after each commit. No damage
+	// means the whole framebuffer.
+	struct drm_mode_rect *damage;
+	size_t damage_len, damage_cap;
+
+	// Last FB_DAMAGE_CLIPS blob, re-used if the damage doesn't change
+	uint32_t damage_blob_id;
+	struct drm_mode_rect *damage_blob_rects;
+	size_t damage_blob_len;
+};
+
+// Log-linear histogram: values are grouped by power of two, with 8 linear
+// sub-buckets each, so recorded values are off by at most 12.5%
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+struct histogram {
+	uint64_t counts[HISTOGRAM_BUCKETS];
+	uint64_t total, max;
+};
+
+// Page-flip timing of a CRTC, cheap enough to be always enabled
+struct frame_stats {
+	uint64_t submit_ns; // time of the pending commit, 0 if none
+	uint64_t last_flip_ns; // 0 if none
+	unsigned int last_sequence;
+
+	uint64_t frames;
+	uint64_t missed_vblanks;
+	struct histogram latency_us; // commit to page-flip
+	struct histogram interval_us; // page-flip to page-flip
 };
 
 struct crtc {
 	struct device *dev;
 	uint32_t id;
 
-	drmModeModeInfo *mode;
+	const drmModeModeInfo *mode; // NULL or points to mode_info
+	drmModeModeInfo mode_info;
 	uint32_t mode_id;
 	bool active;
 
@@ -68,6 +192,28 @@ struct crtc {
 		uint32_t active;
 		uint32_t mode_id;
 	} props;
+
+	struct obj_state prop_state;
+	struct obj_snapshot snapshot;
+	// The next commit needs to emit all properties of the CRTC, its
+	// connectors and its planes
+	bool full_commit;
+
+	struct frame_stats stats;
+	bool flip_pending;
+	bool commit_requested; // see crtc_request_commit
+
+	struct cursor *cursor; // can be NULL
+	bool cursor_requested; // see cursor_move
+	bool cursor_flip; // the pending page-flip only updated the cursor
+
+	// Called when a commit with a page-flip event is sent for the CRTC, with a
+	// status of 0. When device_flush gets the commit rejected, called with a
+	// negative errno value instead of aborting.
+	void (*commit_handler)(struct crtc *crtc, int status, void *data);
+	// Called when a page-flip event is received for the CRTC
+	void (*page_flip_handler)(struct crtc *crtc, void *data);
+	void *page_flip_data; // passed to both handlers
 };
 
 struct connector {
@@ -79,6 +225,7 @@ struct connector {
 
 	drmModeModeInfo *modes;
 	size_t modes_len;
+	bool probed; // state and modes are fresh, see connector_probe
 
 	struct crtc *crtc; // can be NULL
 
@@ -86,7 +233,15 @@ struct connector {
 		uint32_t crtc_id;
 	} props;
 
-	drmModeCrtc *old_crtc;
+	struct obj_state prop_state;
+	struct obj_snapshot snapshot;
+};
+
+enum device_init_flags {
+	// Use the connector state cached by the kernel instead of probing
+	DEVICE_INIT_FAST_PROBE = 1 << 0,
+	// Initialize connectors and planes concurrently
+	DEVICE_INIT_PARALLEL = 1 << 1,
 };
 
 struct device {
@@ -95,6 +250,9 @@ struct device {
 
 	struct {
 		bool dumb;
+		bool prefer_shadow;
+		bool crtc_in_vblank_event;
+		bool atomic_async_page_flip;
 		uint32_t cursor_width, cursor_height;
 	} caps;
 
@@ -106,19 +264,210 @@ struct device {
 
 	size_t planes_len;
 	struct plane *planes;
+
+	// Property metadata shared by all objects, sorted by property ID
+	struct {
+		pthread_mutex_t mutex; // for parallel init
+		struct prop_info *entries;
+		size_t len, cap;
+		size_t hits, misses;
+	} prop_cache;
+
+	// Property blobs shared by contents, see device_blob_ref
+	struct {
+		struct blob_entry *entries; // oldest first
+		size_t len, cap;
+		size_t hits, misses;
+	} blob_cache;
 };
 
-void device_init(struct device *dev, const char *path);
+struct commit_plan_obj {
+	uint32_t id;
+	struct obj_state *state;
+	uint32_t mask; // pending_mask the layout was recorded with
+};
+
+// Pre-sorted DRM_IOCTL_MODE_ATOMIC arguments for a CRTC. The layout is
+// recorded once, then only the values are patched on each commit.
+struct commit_plan {
+	struct crtc *crtc;
+
+	size_t entries_len;
+	struct commit_plan_obj *entries; // in update order
+
+	size_t objs_len;
+	uint32_t *objs;
+	uint32_t *count_props;
+
+	size_t props_len;
+	uint32_t *props;
+	uint64_t *values;
+	const uint64_t **sources; // pending values to copy into values
+};
+
+// Owns the cursor plane of a CRTC. Cursor updates only submit the properties
+// of that plane, at most once per vblank.
+struct cursor {
+	struct crtc *crtc;
+	struct plane *plane;
+	bool async; // try DRM_MODE_PAGE_FLIP_ASYNC for image changes
+
+	uint64_t updates, commits;
+};
+
+// A buffer to display on a CRTC, see plane_alloc_assign
+struct layer {
+	struct framebuffer *fb;
+	uint32_t x, y;
+	uint32_t width, height;
+	float alpha;
+
+	struct plane *plane; // NULL if the layer needs to be composited
+};
+
+#define PLANE_ALLOC_MAX_LAYERS 8
+#define PLANE_ALLOC_MAX_CANDIDATES 32
+#define PLANE_ALLOC_CACHE_SIZE 32
+
+// Everything a cached assignment depends on. Compared with memcmp, so it must
+// be zeroed before being filled, and only has uint32_t fields to avoid
+// padding.
+struct plane_alloc_key {
+	uint32_t mode_width, mode_height;
+	uint32_t composite_format, composite_width, composite_height;
+	uint32_t layers_len;
+	struct {
+		uint32_t format;
+		uint32_t fb_width, fb_height;
+		uint32_t width, height;
+		uint32_t translucent; // alpha < 1
+		uint32_t inside; // fully inside the CRTC
+	} layers[PLANE_ALLOC_MAX_LAYERS];
+	uint32_t candidates_len;
+	uint32_t candidates[PLANE_ALLOC_MAX_CANDIDATES]; // plane IDs
+};
+
+struct plane_alloc_result {
+	bool valid;
+	uint64_t hash; // of key
+	struct plane_alloc_key key;
+	size_t composited;
+	struct plane *planes[PLANE_ALLOC_MAX_LAYERS];
+};
+
+// Assigns layers to the planes of a CRTC with TEST_ONLY commits. Rejected
+// configurations and the final assignment for a set of layers are cached.
+struct plane_alloc {
+	struct crtc *crtc;
+	struct plane *primary;
+
+	struct plane_alloc_result results[PLANE_ALLOC_CACHE_SIZE];
+	size_t results_len, results_next;
+	uint64_t rejected[4 * PLANE_ALLOC_CACHE_SIZE]; // configuration hashes
+	size_t rejected_len, rejected_next;
+
+	struct plane_alloc_result current;
+
+	uint64_t assigns, searches, test_commits;
+};
+
+// Blends layers into a framebuffer on the CPU, for layers which couldn't be
+// assigned to a plane
+struct compositor {
+	struct thread_pool *pool;
+};
+
+// Wakes up the renderer as late as possible before the next vblank
+struct repaint_scheduler {
+	struct crtc *crtc;
+	int timer_fd;
+
+	uint64_t margin_ns; // configured safety margin
+	uint64_t extra_margin_ns; // grows when deadlines are missed
+	uint64_t render_ns; // moving average of the render duration
+
+	uint64_t target_vblank_ns; // 0 if no repaint is scheduled
+	uint64_t render_start_ns;
+	uint64_t missed_deadlines;
+};
+
+enum event_source_type {
+	EVENT_SOURCE_FD,
+	EVENT_SOURCE_TIMER,
+	EVENT_SOURCE_USER,
+	EVENT_SOURCE_DEVICE,
+};
+
+struct event_source;
+
+typedef void (*event_source_func)(struct event_source *source, uint32_t events,
+	void *data);
+
+struct event_source {
+	struct event_loop *loop;
+	enum event_source_type type;
+	int fd;
+
+	event_source_func func;
+	void *data;
+
+	// For EVENT_SOURCE_DEVICE
+	struct device *dev;
+	struct event_source *next_device;
+};
+
+struct event_loop {
+	int epoll_fd;
+	struct event_source *devices;
+};
+
+void device_init(struct device *dev, const char *path, uint32_t flags);
 void device_finish(struct device *dev);
 void device_commit(struct device *dev, uint32_t flags);
+void device_commit_crtcs(struct device *dev, struct crtc **crtcs,
+	size_t crtcs_len, uint32_t flags);
+int device_try_commit_crtcs(struct device *dev, struct crtc **crtcs,
+	size_t crtcs_len, uint32_t flags);
+void device_flush(struct device *dev);
+bool device_needs_modeset(struct device *dev);
+void device_restore(struct device *dev);
+size_t device_enable_outputs(struct device *dev);
 
+void connector_probe(struct connector *conn);
 bool connector_set_crtc(struct connector *conn, struct crtc *crtc);
 
-void crtc_commit(struct crtc *crtc, uint32_t flags, void *user_data);
+void crtc_commit(struct crtc *crtc, uint32_t flags);
+int crtc_try_commit(struct crtc *crtc, uint32_t flags);
+void crtc_request_commit(struct crtc *crtc);
 void crtc_set_mode(struct crtc *crtc, const drmModeModeInfo *mode);
+void crtc_handle_page_flip(struct crtc *crtc, unsigned int sequence,
+	unsigned int tv_sec, unsigned int tv_usec);
+
+bool cursor_init(struct cursor *cursor, struct crtc *crtc);
+void cursor_finish(struct cursor *cursor);
+void cursor_set_image(struct cursor *cursor, struct framebuffer *fb);
+void cursor_move(struct cursor *cursor, uint32_t x, uint32_t y);
+
+void commit_plan_init(struct commit_plan *plan, struct crtc *crtc);
+void commit_plan_finish(struct commit_plan *plan);
+void commit_plan_prepare(struct commit_plan *plan);
+int commit_plan_commit(struct commit_plan *plan, uint32_t flags);
+
+void plane_alloc_init(struct plane_alloc *alloc, struct crtc *crtc);
+void plane_alloc_finish(struct plane_alloc *alloc);
+size_t plane_alloc_assign(struct plane_alloc *alloc, struct layer *layers,
+	size_t layers_len, struct framebuffer *composite);
+void plane_alloc_handle_commit_failure(struct plane_alloc *alloc);
+
+void compositor_init(struct compositor *comp, struct thread_pool *pool);
+void compositor_finish(struct compositor *comp);
+void compositor_composite(struct compositor *comp,
+	struct framebuffer_dumb *dst, const struct layer *layers,
+	size_t layers_len, const struct rect *damage);
 
 void plane_set_framebuffer(struct plane *plane, struct framebuffer *fb);
 bool plane_set_crtc(struct plane *plane, struct crtc *crtc);
+void plane_add_damage(struct plane *plane, const struct rect *rect);
 
 void framebuffer_dumb_init(struct framebuffer_dumb *fb, struct device *dev,
 	uint32_t fmt, uint32_t width, uint32_t height);
@@ -126,5 +475,59 @@ void framebuffer_dumb_finish(struct framebuffer_dumb *fb);
 void framebuffer_dumb_map(struct framebuffer_dumb *fb, uint32_t flags,
 	void **data_ptr);
 void framebuffer_dumb_unmap(struct framebuffer_dumb *fb, void *data);
+void framebuffer_dumb_enable_shadow(struct framebuffer_dumb *fb);
+void framebuffer_dumb_damage_rows(struct framebuffer_dumb *fb, uint32_t y,
+	uint32_t height);
+void framebuffer_dumb_flush(struct framebuffer_dumb *fb);
+
+void swapchain_init(struct swapchain *sc, struct device *dev,
+	struct plane *plane, uint32_t fmt, uint32_t width, uint32_t height,
+	size_t len);
+void swapchain_finish(struct swapchain *sc);
+struct framebuffer_dumb *swapchain_acquire(struct swapchain *sc);
+void swapchain_queue(struct swapchain *sc, struct framebuffer_dumb *fb);
+void swapchain_release(struct swapchain *sc, struct framebuffer_dumb *fb);
+void swapchain_handle_commit(struct swapchain *sc);
+void swapchain_handle_cancel(struct swapchain *sc, struct framebuffer_dumb *fb);
+void swapchain_handle_page_flip(struct swapchain *sc);
+void swapchain_add_damage(struct swapchain *sc, const struct rect *rect);
+void swapchain_get_repaint(struct swapchain *sc, struct framebuffer_dumb *fb,
+	struct rect *repaint);
+
+void repaint_scheduler_init(struct repaint_scheduler *sched,
+	struct crtc *crtc, uint64_t margin_ns);
+void repaint_scheduler_finish(struct repaint_scheduler *sched);
+void repaint_scheduler_schedule(struct repaint_scheduler *sched);
+bool repaint_scheduler_dispatch(struct repaint_scheduler *sched);
+void repaint_scheduler_render_done(struct repaint_scheduler *sched);
+void repaint_scheduler_handle_page_flip(struct repaint_scheduler *sched);
+
+void event_loop_init(struct event_loop *loop);
+void event_loop_finish(struct event_loop *loop);
+int event_loop_dispatch(struct event_loop *loop, int timeout_ms);
+struct event_source *event_loop_add_fd(struct event_loop *loop, int fd,
+	uint32_t events, event_source_func func, void *data);
+struct event_source *event_loop_add_timer(struct event_loop *loop,
+	event_source_func func, void *data);
+struct event_source *event_loop_add_user(struct event_loop *loop,
+	event_source_func func, void *data);
+struct event_source *event_loop_add_device(struct event_loop *loop,
+	struct device *dev);
+void event_source_remove(struct event_source *source);
+void event_source_timer_arm(struct event_source *source, uint64_t time_ns);
+void event_source_signal(struct event_source *source);
+
+void histogram_add(struct histogram *hist, uint64_t value);
+uint64_t histogram_percentile(const struct histogram *hist, double percentile);
+
+void frame_stats_submit(struct frame_stats *stats);
+void frame_stats_page_flip(struct frame_stats *stats, unsigned int sequence,
+	uint64_t flip_ns);
+void frame_stats_print(const struct frame_stats *stats, uint32_t crtc_id);
+
+bool rect_empty(const struct rect *rect);
+void rect_union(struct rect *dst, const struct rect *src);
+bool rect_intersect(struct rect *dst, const struct rect *a,
+	const struct rect *b);
 
 #endif
@@ -17,23 +17,67 @@ struct prop {
 	bool required;
 };
 
+// Cached drmModeGetProperty result
+struct prop_info {
+	uint32_t id;
+	uint32_t flags;
+	char name[DRM_PROP_NAME_LEN];
+
+	struct drm_mode_property_enum *enums;
+	size_t enums_len;
+};
+
+void device_prop_cache_finish(struct device *dev);
+
+struct blob_entry {
+	uint32_t id;
+	uint64_t hash;
+	void *data;
+	size_t size;
+	size_t refs; // unreferenced blobs are kept for a while
+};
+
+uint32_t device_blob_ref(struct device *dev, const void *data, size_t size);
+void device_blob_unref(struct device *dev, uint32_t blob_id);
+void device_blob_cache_finish(struct device *dev);
+
 void read_obj_props(struct device *dev, uint32_t obj_id, uint32_t obj_type,
-	struct prop *props, size_t props_len);
+	struct prop *props, size_t props_len, struct obj_snapshot *snapshot);
+void obj_snapshot_finish(struct obj_snapshot *snapshot);
+
+// Adds the property to the request if it changed since the last commit, or
+// if full is set. A NULL request only records the pending value.
+void obj_state_add(struct obj_state *state, drmModeAtomicReq *req,
+	uint32_t obj_id, uint32_t prop_id, uint64_t value, bool full);
+void obj_state_init_value(struct obj_state *state, uint32_t obj_id,
+	uint32_t prop_id, uint64_t value);
+bool obj_state_changed(const struct obj_state *state, uint32_t prop_id);
+void obj_state_apply(struct obj_state *state);
+void obj_state_discard(struct obj_state *state);
+void obj_state_forget(struct obj_state *state);
 
 struct crtc *device_find_crtc(struct device *dev, uint32_t crtc_id);
 
 void connector_init(struct connector *conn, struct device *dev,
-	uint32_t conn_id, struct encoder *encoders, size_t encoders_len);
+	uint32_t conn_id, struct encoder *encoders, size_t encoders_len,
+	bool probe);
 void connector_finish(struct connector *conn);
-void connector_update(struct connector *conn, drmModeAtomicReq *req);
+void device_handle_commit(struct device *dev, uint32_t flags, int ret);
+
+void connector_update(struct connector *conn, drmModeAtomicReq *req,
+	bool full);
 
 void crtc_init(struct crtc *crtc, struct device *dev, uint32_t crtc_id);
 void crtc_finish(struct crtc *crtc);
-void crtc_update(struct crtc *crtc, drmModeAtomicReq *req);
+void crtc_update(struct crtc *crtc, drmModeAtomicReq *req, bool full);
+void crtc_add_to_request(struct crtc *crtc, drmModeAtomicReq *req, bool full,
+	uint32_t flags);
+
+int cursor_commit(struct cursor *cursor);
 
 void plane_init(struct plane *plane, struct device *dev,
 	uint32_t plane_id);
 void plane_finish(struct plane *plane);
-void plane_update(struct plane *plane, drmModeAtomicReq *req);
+void plane_update(struct plane *plane, drmModeAtomicReq *req, bool full);
 
 #endif
@@ -0,0 +1,97 @@
+#ifndef DP_KMS_THREAD_H
+#define DP_KMS_THREAD_H
+
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dp.h"
+
+// Lock-free single-producer single-consumer ring of fixed-size elements
+struct spsc_ring {
+	uint8_t *data;
+	size_t elem_size;
+	size_t cap; // power of two
+
+	alignas(64) atomic_size_t head; // written by the consumer
+	alignas(64) atomic_size_t tail; // written by the producer
+};
+
+void spsc_ring_init(struct spsc_ring *ring, size_t elem_size, size_t cap);
+void spsc_ring_finish(struct spsc_ring *ring);
+bool spsc_ring_push(struct spsc_ring *ring, const void *elem);
+void *spsc_ring_peek(struct spsc_ring *ring);
+void spsc_ring_pop(struct spsc_ring *ring);
+
+#define KMS_FRAME_MAX_PLANES 8
+
+struct kms_plane_state {
+	struct plane *plane;
+	struct framebuffer *fb; // NULL disables the plane
+	uint32_t x, y;
+	uint32_t width, height;
+	float alpha;
+	struct rect damage; // in framebuffer coordinates, empty if unknown
+};
+
+// A snapshot of the planes of a CRTC for one frame. Timestamps are
+// CLOCK_MONOTONIC nanoseconds.
+struct kms_frame {
+	struct crtc *crtc;
+	size_t planes_len;
+	struct kms_plane_state planes[KMS_FRAME_MAX_PLANES];
+	void *user_data;
+
+	uint64_t render_start_ns; // set by the caller, can be 0
+	uint64_t submit_ns; // pushed into the ring
+	uint64_t dequeue_ns; // picked up by the KMS thread
+	uint64_t commit_start_ns; // the KMS thread starts the atomic commit
+	uint64_t commit_end_ns; // the atomic ioctl returned
+	uint64_t flip_ns; // vblank timestamp of the page-flip
+};
+
+// Called on the render thread when a frame has been displayed, or with a
+// negative errno value as status if it wasn't: -ECANCELED if a newer frame for
+// the same CRTC replaced it before it could be committed, or the error of the
+// failed commit
+typedef void (*kms_frame_func)(const struct kms_frame *frame, int status,
+	void *data);
+
+struct kms_crtc_slot {
+	bool queued, in_flight;
+	struct kms_frame queued_frame, in_flight_frame;
+};
+
+// Owns the DRM device once started: the atomic requests are built and
+// submitted on the KMS thread, other threads only publish frames
+struct kms_thread {
+	struct device *dev;
+	pthread_t thread;
+	atomic_bool stop;
+
+	struct spsc_ring frames; // render thread to KMS thread
+	struct spsc_ring events; // KMS thread to render thread
+
+	// Owned by the KMS thread
+	struct event_loop loop;
+	struct event_source *dev_source, *wake_source;
+	struct kms_crtc_slot *slots; // one per CRTC
+
+	// Owned by the render thread
+	size_t outstanding; // frames submitted whose event wasn't handled yet
+	struct event_source *done_source;
+	kms_frame_func frame_func;
+	void *frame_data;
+	struct histogram queue_us, wait_us, commit_us, flip_us, render_us;
+};
+
+void kms_thread_init(struct kms_thread *kt, struct device *dev,
+	struct event_loop *loop, kms_frame_func func, void *data);
+void kms_thread_finish(struct kms_thread *kt);
+bool kms_thread_submit(struct kms_thread *kt, struct kms_frame *frame);
+void kms_thread_print_stats(struct kms_thread *kt);
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef DP_PIXEL_H
+#define DP_PIXEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Pixel kernels for 32-bit little-endian ARGB8888/XRGB8888 data. Strides are
+// in bytes, like framebuffer_dumb.stride. Blending assumes premultiplied
+// alpha.
+
+struct pixel_impl {
+	const char *name;
+
+	void (*fill)(void *dst, uint32_t dst_stride, uint32_t width,
+		uint32_t height, uint32_t color);
+	void (*copy)(void *dst, uint32_t dst_stride, const void *src,
+		uint32_t src_stride, uint32_t width, uint32_t height);
+	// Same as copy, but bypasses the cache for the destination. Meant for
+	// write-combined mappings.
+	void (*copy_stream)(void *dst, uint32_t dst_stride, const void *src,
+		uint32_t src_stride, uint32_t width, uint32_t height);
+	// dst = src * alpha + dst * (1 - src_alpha * alpha)
+	void (*blend)(void *dst, uint32_t dst_stride, const void *src,
+		uint32_t src_stride, uint32_t width, uint32_t height, uint8_t alpha);
+	// Same as blend, with the source alpha channel treated as 0xFF, e.g. for
+	// XRGB8888 sources: dst = src * alpha + dst * (1 - alpha)
+	void (*blend_opaque)(void *dst, uint32_t dst_stride, const void *src,
+		uint32_t src_stride, uint32_t width, uint32_t height, uint8_t alpha);
+};
+
+// Returns the implementations supported by the CPU, the best one last
+size_t pixel_get_impls(const struct pixel_impl **impls, size_t impls_cap);
+const struct pixel_impl *pixel_get_impl(void);
+
+void pixel_fill(void *dst, uint32_t dst_stride, uint32_t width,
+	uint32_t height, uint32_t color);
+void pixel_copy(void *dst, uint32_t dst_stride, const void *src,
+	uint32_t src_stride, uint32_t width, uint32_t height);
+void pixel_copy_stream(void *dst, uint32_t dst_stride, const void *src,
+	uint32_t src_stride, uint32_t width, uint32_t height);
+void pixel_blend(void *dst, uint32_t dst_stride, const void *src,
+	uint32_t src_stride, uint32_t width, uint32_t height, uint8_t alpha);
+void pixel_blend_opaque(void *dst, uint32_t dst_stride, const void *src,
+	uint32_t src_stride, uint32_t width, uint32_t height, uint8_t alpha);
+
+#endif
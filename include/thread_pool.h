@@ -0,0 +1,64 @@
+#ifndef DP_THREAD_POOL_H
+#define DP_THREAD_POOL_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dp.h"
+
+// A fixed pool of workers running row tiles of a rectangle in parallel. Each
+// worker has its own task deque: it pops from the back of its own deque, and
+// steals from the front of the others' when it runs out of work.
+
+typedef void (*thread_pool_func)(void *data, const struct rect *tile);
+
+struct thread_pool_task {
+	struct thread_pool_job *job;
+	struct rect tile;
+};
+
+struct thread_pool_deque {
+	pthread_mutex_t mutex;
+	struct thread_pool_task *tasks; // ring buffer
+	size_t head, len, cap;
+};
+
+struct thread_pool_worker {
+	struct thread_pool *pool;
+	size_t idx;
+	pthread_t thread;
+};
+
+struct thread_pool {
+	size_t workers_len;
+	struct thread_pool_worker *workers;
+	// One per worker, plus one for threads outside the pool
+	struct thread_pool_deque *deques;
+	atomic_size_t next_deque; // round-robin submission
+
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond, done_cond;
+	atomic_size_t queued;
+	bool stop;
+
+	atomic_uint_fast64_t steals;
+};
+
+struct thread_pool_job {
+	thread_pool_func func;
+	void *data;
+
+	atomic_size_t pending;
+};
+
+void thread_pool_init(struct thread_pool *pool, size_t workers_len);
+void thread_pool_finish(struct thread_pool *pool);
+size_t thread_pool_tile_rows(uint32_t stride, uint32_t min_rows);
+void thread_pool_submit(struct thread_pool *pool, struct thread_pool_job *job,
+	const struct rect *rect, uint32_t tile_rows);
+void thread_pool_wait(struct thread_pool *pool, struct thread_pool_job *job);
+
+#endif
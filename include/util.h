@@ -3,6 +3,7 @@
 
 #include <errno.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdnoreturn.h>
 #include <string.h>
 
@@ -10,5 +11,9 @@ noreturn void fatal(const char *fmt, ...);
 #define fatal_errno(fmt, ...) fatal(fmt ": %s", ##__VA_ARGS__, strerror(errno))
 
 void *xalloc(size_t size);
+void *xrealloc(void *ptr, size_t size);
+
+// CLOCK_MONOTONIC, like page-flip timestamps
+uint64_t now_ns(void);
 
 #endif
@@ -0,0 +1,363 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+
+#include <xf86drm.h>
+
+#include "kms_thread.h"
+#include "util.h"
+
+#define FRAMES_CAP 16
+
+struct kms_event {
+	struct kms_frame frame;
+	int status;
+};
+
+void spsc_ring_init(struct spsc_ring *ring, size_t elem_size, size_t cap) {
+	if (cap == 0 || (cap & (cap - 1)) != 0) {
+		fatal("ring capacity must be a power of two");
+	}
+	ring->data = xalloc(elem_size * cap);
+	ring->elem_size = elem_size;
+	ring->cap = cap;
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+}
+
+void spsc_ring_finish(struct spsc_ring *ring) {
+	free(ring->data);
+}
+
+// Producer side, returns false if the ring is full
+bool spsc_ring_push(struct spsc_ring *ring, const void *elem) {
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	if (tail - head == ring->cap) {
+		return false;
+	}
+
+	memcpy(ring->data + (tail & (ring->cap - 1)) * ring->elem_size, elem,
+		ring->elem_size);
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+	return true;
+}
+
+// Consumer side, returns the oldest element without removing it, or NULL if
+// the ring is empty
+void *spsc_ring_peek(struct spsc_ring *ring) {
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	if (head == tail) {
+		return NULL;
+	}
+	return ring->data + (head & (ring->cap - 1)) * ring->elem_size;
+}
+
+// Consumer side, removes the element returned by spsc_ring_peek
+void spsc_ring_pop(struct spsc_ring *ring) {
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+static void push_event(struct kms_thread *kt, const struct kms_frame *frame,
+		int status) {
+	struct kms_event event = { .frame = *frame, .status = status };
+	if (!spsc_ring_push(&kt->events, &event)) {
+		fatal("KMS thread event ring overflow");
+	}
+	event_source_signal(kt->done_source);
+}
+
+// Runs on the KMS thread
+static void apply_frame(const struct kms_frame *frame) {
+	for (size_t i = 0; i < frame->planes_len; ++i) {
+		const struct kms_plane_state *state = &frame->planes[i];
+		struct plane *plane = state->plane;
+
+		if (!plane_set_crtc(plane, frame->crtc)) {
+			fatal("plane %"PRIu32" can't be used with CRTC %"PRIu32,
+				plane->id, frame->crtc->id);
+		}
+		plane_set_framebuffer(plane, state->fb);
+		plane->x = state->x;
+		plane->y = state->y;
+		plane->width = state->width;
+		plane->height = state->height;
+		plane->alpha = state->alpha;
+		if (!rect_empty(&state->damage)) {
+			plane_add_damage(plane, &state->damage);
+		}
+	}
+}
+
+// The newer frame replaces the older one, which was never displayed. Planes
+// only present in the older frame are carried over. The damage of planes in
+// both frames is accumulated, since it's relative to the last displayed
+// frame.
+static void merge_frame(struct kms_frame *frame, const struct kms_frame *older) {
+	for (size_t i = 0; i < older->planes_len; ++i) {
+		const struct kms_plane_state *old_state = &older->planes[i];
+
+		struct kms_plane_state *state = NULL;
+		for (size_t j = 0; j < frame->planes_len; ++j) {
+			if (frame->planes[j].plane == old_state->plane) {
+				state = &frame->planes[j];
+				break;
+			}
+		}
+
+		if (state == NULL) {
+			if (frame->planes_len == KMS_FRAME_MAX_PLANES) {
+				fatal("too many planes in merged frame");
+			}
+			frame->planes[frame->planes_len++] = *old_state;
+		} else if (rect_empty(&old_state->damage)) {
+			// Unknown damage means the whole framebuffer
+			state->damage = (struct rect){ 0 };
+		} else if (!rect_empty(&state->damage)) {
+			rect_union(&state->damage, &old_state->damage);
+		}
+	}
+
+	if (older->render_start_ns != 0 &&
+			older->render_start_ns < frame->render_start_ns) {
+		frame->render_start_ns = older->render_start_ns;
+	}
+}
+
+// Dequeues frames, and commits the CRTCs which have a frame and no pending
+// page-flip in a single atomic request. Busy CRTCs don't hold back the others.
+static void process_frames(struct kms_thread *kt) {
+	struct device *dev = kt->dev;
+
+	struct kms_frame *frame;
+	while ((frame = spsc_ring_peek(&kt->frames)) != NULL) {
+		struct kms_crtc_slot *slot = &kt->slots[frame->crtc - dev->crtcs];
+		struct kms_frame next = *frame;
+		spsc_ring_pop(&kt->frames);
+		next.dequeue_ns = now_ns();
+
+		if (slot->queued) {
+			merge_frame(&next, &slot->queued_frame);
+			push_event(kt, &slot->queued_frame, -ECANCELED);
+		}
+		slot->queued_frame = next;
+		slot->queued = true;
+	}
+
+	struct crtc *crtcs[dev->crtcs_len + 1];
+	size_t crtcs_len = 0;
+	for (size_t i = 0; i < dev->crtcs_len; ++i) {
+		struct kms_crtc_slot *slot = &kt->slots[i];
+		if (!slot->queued || slot->in_flight) {
+			continue;
+		}
+
+		apply_frame(&slot->queued_frame);
+		slot->in_flight_frame = slot->queued_frame;
+		slot->in_flight = true;
+		slot->queued = false;
+		crtcs[crtcs_len++] = &dev->crtcs[i];
+	}
+	if (crtcs_len == 0) {
+		return;
+	}
+
+	uint32_t flags = DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_NONBLOCK;
+	uint64_t start_ns = now_ns();
+	int ret = device_try_commit_crtcs(dev, crtcs, crtcs_len, flags);
+	uint64_t end_ns = now_ns();
+
+	int rets[crtcs_len];
+	for (size_t i = 0; i < crtcs_len; ++i) {
+		struct kms_crtc_slot *slot = &kt->slots[crtcs[i] - dev->crtcs];
+		slot->in_flight_frame.commit_start_ns = start_ns;
+		slot->in_flight_frame.commit_end_ns = end_ns;
+		rets[i] = ret;
+	}
+	if (ret == -EBUSY && crtcs_len > 1) {
+		// Find out which CRTCs are busy, so that they don't delay the others
+		for (size_t i = 0; i < crtcs_len; ++i) {
+			struct kms_crtc_slot *slot = &kt->slots[crtcs[i] - dev->crtcs];
+			slot->in_flight_frame.commit_start_ns = now_ns();
+			rets[i] = device_try_commit_crtcs(dev, &crtcs[i], 1, flags);
+			slot->in_flight_frame.commit_end_ns = now_ns();
+		}
+	}
+
+	for (size_t i = 0; i < crtcs_len; ++i) {
+		struct kms_crtc_slot *slot = &kt->slots[crtcs[i] - dev->crtcs];
+		if (rets[i] == -EBUSY) {
+			// Retried after the next wakeup, unless a newer frame arrives
+			slot->queued_frame = slot->in_flight_frame;
+			slot->queued = true;
+			slot->in_flight = false;
+		} else if (rets[i] != 0) {
+			slot->in_flight = false;
+			push_event(kt, &slot->in_flight_frame, rets[i]);
+		}
+	}
+}
+
+static void handle_page_flip(struct crtc *crtc, void *data) {
+	struct kms_thread *kt = data;
+	struct kms_crtc_slot *slot = &kt->slots[crtc - kt->dev->crtcs];
+
+	if (!slot->in_flight) {
+		return;
+	}
+	slot->in_flight_frame.flip_ns = crtc->stats.last_flip_ns;
+	slot->in_flight = false;
+	push_event(kt, &slot->in_flight_frame, 0);
+}
+
+static void handle_wake(struct event_source *source, uint32_t events,
+		void *data) {
+	// Frames are processed after each dispatch
+}
+
+static void *kms_thread_run(void *data) {
+	struct kms_thread *kt = data;
+
+	while (!atomic_load(&kt->stop)) {
+		int ret = event_loop_dispatch(&kt->loop, -1);
+		if (ret < 0) {
+			errno = -ret;
+			fatal_errno("event_loop_dispatch failed");
+		}
+		process_frames(kt);
+	}
+
+	return NULL;
+}
+
+// Runs on the render thread, which owns the loop
+static void handle_done(struct event_source *source, uint32_t events,
+		void *data) {
+	struct kms_thread *kt = data;
+
+	struct kms_event *event;
+	while ((event = spsc_ring_peek(&kt->events)) != NULL) {
+		struct kms_event ev = *event;
+		spsc_ring_pop(&kt->events);
+		--kt->outstanding;
+
+		const struct kms_frame *frame = &ev.frame;
+		if (frame->render_start_ns != 0) {
+			histogram_add(&kt->render_us,
+				(frame->submit_ns - frame->render_start_ns) / 1000);
+		}
+		histogram_add(&kt->queue_us,
+			(frame->dequeue_ns - frame->submit_ns) / 1000);
+		histogram_add(&kt->wait_us,
+			(frame->commit_start_ns - frame->dequeue_ns) / 1000);
+		histogram_add(&kt->commit_us,
+			(frame->commit_end_ns - frame->commit_start_ns) / 1000);
+		if (ev.status == 0 && frame->flip_ns > frame->commit_end_ns) {
+			histogram_add(&kt->flip_us,
+				(frame->flip_ns - frame->commit_end_ns) / 1000);
+		}
+
+		kt->frame_func(frame, ev.status, kt->frame_data);
+	}
+}
+
+// Starts the KMS thread. From now on, the device and its objects must only be
+// used from the KMS thread. func is called from loop, which belongs to the
+// render thread.
+void kms_thread_init(struct kms_thread *kt, struct device *dev,
+		struct event_loop *loop, kms_frame_func func, void *data) {
+	memset(kt, 0, sizeof(*kt));
+	kt->dev = dev;
+	kt->frame_func = func;
+	kt->frame_data = data;
+	atomic_init(&kt->stop, false);
+
+	// Each CRTC has at most one queued and one in-flight frame
+	size_t events_cap = FRAMES_CAP;
+	while (events_cap < FRAMES_CAP + 2 * dev->crtcs_len) {
+		events_cap *= 2;
+	}
+	spsc_ring_init(&kt->frames, sizeof(struct kms_frame), FRAMES_CAP);
+	spsc_ring_init(&kt->events, sizeof(struct kms_event), events_cap);
+
+	kt->slots = xalloc(dev->crtcs_len * sizeof(kt->slots[0]));
+	for (size_t i = 0; i < dev->crtcs_len; ++i) {
+		dev->crtcs[i].page_flip_handler = handle_page_flip;
+		dev->crtcs[i].page_flip_data = kt;
+	}
+
+	event_loop_init(&kt->loop);
+	kt->dev_source = event_loop_add_device(&kt->loop, dev);
+	kt->wake_source = event_loop_add_user(&kt->loop, handle_wake, kt);
+
+	kt->done_source = event_loop_add_user(loop, handle_done, kt);
+
+	int ret = pthread_create(&kt->thread, NULL, kms_thread_run, kt);
+	if (ret != 0) {
+		fatal("pthread_create failed: %d", ret);
+	}
+}
+
+// Stops the KMS thread, frames still in the ring are dropped. The device can be
+// used from the calling thread again afterwards.
+void kms_thread_finish(struct kms_thread *kt) {
+	atomic_store(&kt->stop, true);
+	event_source_signal(kt->wake_source);
+	pthread_join(kt->thread, NULL);
+
+	for (size_t i = 0; i < kt->dev->crtcs_len; ++i) {
+		kt->dev->crtcs[i].page_flip_handler = NULL;
+		kt->dev->crtcs[i].page_flip_data = NULL;
+	}
+
+	event_source_remove(kt->done_source);
+	event_source_remove(kt->wake_source);
+	event_source_remove(kt->dev_source);
+	event_loop_finish(&kt->loop);
+	free(kt->slots);
+	spsc_ring_finish(&kt->events);
+	spsc_ring_finish(&kt->frames);
+}
+
+// Publishes a frame from the render thread. Returns false if the ring is full,
+// or if too many frames are waiting for their event to be handled, in which
+// case the frame isn't displayed.
+bool kms_thread_submit(struct kms_thread *kt, struct kms_frame *frame) {
+	if (frame->planes_len > KMS_FRAME_MAX_PLANES) {
+		fatal("too many planes in frame: %zu", frame->planes_len);
+	}
+
+	// Each frame ends up as exactly one event, replaced frames included
+	if (kt->outstanding == kt->events.cap) {
+		return false;
+	}
+
+	frame->submit_ns = now_ns();
+	if (!spsc_ring_push(&kt->frames, frame)) {
+		return false;
+	}
+	++kt->outstanding;
+	event_source_signal(kt->wake_source);
+	return true;
+}
+
+static void print_histogram(const char *name, const struct histogram *hist) {
+	printf("  %s: p50 %"PRIu64" us, p99 %"PRIu64" us, max %"PRIu64" us\n",
+		name, histogram_percentile(hist, 50), histogram_percentile(hist, 99),
+		hist->max);
+}
+
+// Time spent in each stage, from the start of rendering to the page-flip
+void kms_thread_print_stats(struct kms_thread *kt) {
+	printf("KMS thread stages:\n");
+	print_histogram("render", &kt->render_us);
+	print_histogram("queue", &kt->queue_us);
+	print_histogram("wait for previous flip", &kt->wait_us);
+	print_histogram("atomic commit", &kt->commit_us);
+	print_histogram("commit to flip", &kt->flip_us);
+}
@@ -0,0 +1,220 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "dp.h"
+#include "util.h"
+
+// The exhaustive search is exponential in the number of connectors, e.g. with
+// MST docks. Past this many steps, the best match found so far is kept.
+#define MATCH_MAX_STEPS 100000
+
+struct match_score {
+	size_t lit; // connectors with a CRTC
+	size_t planes; // overlay planes usable by at least one of the CRTCs
+	size_t kept; // connectors keeping their current CRTC
+};
+
+struct matcher {
+	struct device *dev;
+	struct connector **conns;
+	size_t conns_len;
+
+	int *cur, *best; // CRTC index per connector, -1 if none
+	struct match_score best_score;
+	bool has_best;
+	size_t steps_left;
+};
+
+// A plane can only be used by one CRTC at a time, so planes shared between
+// CRTCs are counted once. Each CRTC gets its own primary and cursor plane, only
+// overlays make a difference.
+static size_t count_planes(struct device *dev, uint32_t crtcs) {
+	size_t n = 0;
+	for (size_t i = 0; i < dev->planes_len; ++i) {
+		struct plane *plane = &dev->planes[i];
+		if (plane->type == DRM_PLANE_TYPE_OVERLAY &&
+				(plane->possible_crtcs & crtcs)) {
+			++n;
+		}
+	}
+	return n;
+}
+
+static bool score_better(const struct match_score *a,
+		const struct match_score *b) {
+	if (a->lit != b->lit) {
+		return a->lit > b->lit;
+	}
+	if (a->planes != b->planes) {
+		return a->planes > b->planes;
+	}
+	return a->kept > b->kept;
+}
+
+static void consider(struct matcher *m, uint32_t used, size_t lit,
+		size_t kept) {
+	struct match_score score = {
+		.lit = lit,
+		.planes = count_planes(m->dev, used),
+		.kept = kept,
+	};
+	if (!m->has_best || score_better(&score, &m->best_score)) {
+		memcpy(m->best, m->cur, m->conns_len * sizeof(m->cur[0]));
+		m->best_score = score;
+		m->has_best = true;
+	}
+}
+
+// Gives each connector its current CRTC if possible, the first free one
+// otherwise
+static void match_greedy(struct matcher *m) {
+	struct device *dev = m->dev;
+	uint32_t used = 0;
+	size_t lit = 0, kept = 0;
+
+	for (size_t i = 0; i < m->conns_len; ++i) {
+		struct connector *conn = m->conns[i];
+		m->cur[i] = -1;
+		for (size_t j = 0; j < dev->crtcs_len; ++j) {
+			uint32_t bit = 1 << j;
+			if ((used & bit) || (conn->possible_crtcs & bit) == 0) {
+				continue;
+			}
+			if (m->cur[i] < 0 || conn->crtc == &dev->crtcs[j]) {
+				m->cur[i] = j;
+			}
+		}
+		if (m->cur[i] >= 0) {
+			used |= 1 << m->cur[i];
+			++lit;
+			kept += conn->crtc == &dev->crtcs[m->cur[i]];
+		}
+	}
+
+	consider(m, used, lit, kept);
+}
+
+static void match(struct matcher *m, size_t i, uint32_t used, size_t lit,
+		size_t kept) {
+	struct device *dev = m->dev;
+
+	if (m->steps_left == 0) {
+		return;
+	}
+	--m->steps_left;
+
+	// Even lighting all remaining connectors can't beat the best match
+	if (m->has_best && lit + (m->conns_len - i) < m->best_score.lit) {
+		return;
+	}
+
+	if (i == m->conns_len) {
+		consider(m, used, lit, kept);
+		return;
+	}
+
+	struct connector *conn = m->conns[i];
+	for (size_t j = 0; j < dev->crtcs_len; ++j) {
+		uint32_t bit = 1 << j;
+		if ((used & bit) || (conn->possible_crtcs & bit) == 0) {
+			continue;
+		}
+		m->cur[i] = j;
+		match(m, i + 1, used | bit, lit + 1,
+			kept + (conn->crtc == &dev->crtcs[j]));
+	}
+
+	m->cur[i] = -1;
+	match(m, i + 1, used, lit, kept);
+}
+
+// Pick the preferred mode
+static const drmModeModeInfo *pick_mode(struct connector *conn) {
+	if (conn->modes_len == 0) {
+		return NULL;
+	}
+	for (size_t i = 0; i < conn->modes_len; ++i) {
+		if (conn->modes[i].type & DRM_MODE_TYPE_PREFERRED) {
+			return &conn->modes[i];
+		}
+	}
+	return &conn->modes[0];
+}
+
+// Lights up as many connected connectors as possible, each on its own CRTC
+// with its preferred mode, and disables all other connectors and CRTCs. The
+// connector-to-CRTC assignment is searched exhaustively, within a bounded
+// number of steps, to maximize the number of overlay planes usable by the
+// enabled CRTCs, preferring to keep the current assignment on ties. Returns the number of enabled outputs. The new
+// configuration needs to be committed with ALLOW_MODESET, unless
+// device_needs_modeset returns false.
+size_t device_enable_outputs(struct device *dev) {
+	struct connector *conns[dev->connectors_len + 1];
+	size_t conns_len = 0;
+	for (size_t i = 0; i < dev->connectors_len; ++i) {
+		struct connector *conn = &dev->connectors[i];
+		// The cached state may be stale if the kernel never probed it
+		if (!conn->probed && conn->state != DRM_MODE_DISCONNECTED &&
+				conn->modes_len == 0) {
+			connector_probe(conn);
+		}
+		if (conn->state != DRM_MODE_CONNECTED) {
+			continue;
+		}
+		if (pick_mode(conn) == NULL) {
+			printf("connector %"PRIu32" has no mode\n", conn->id);
+			continue;
+		}
+		conns[conns_len++] = conn;
+	}
+
+	int cur[conns_len + 1], best[conns_len + 1];
+	struct matcher m = {
+		.dev = dev,
+		.conns = conns,
+		.conns_len = conns_len,
+		.cur = cur,
+		.best = best,
+		.steps_left = MATCH_MAX_STEPS,
+	};
+	match_greedy(&m);
+	match(&m, 0, 0, 0, 0);
+	if (m.steps_left == 0) {
+		printf("connector matching stopped after %d steps\n", MATCH_MAX_STEPS);
+	}
+
+	printf("matched %zu connectors to CRTCs, %zu planes usable\n",
+		m.best_score.lit, m.best_score.planes);
+
+	for (size_t i = 0; i < dev->connectors_len; ++i) {
+		connector_set_crtc(&dev->connectors[i], NULL);
+	}
+
+	bool used[dev->crtcs_len + 1];
+	memset(used, 0, sizeof(used));
+
+	for (size_t i = 0; i < conns_len; ++i) {
+		struct connector *conn = conns[i];
+		if (best[i] < 0) {
+			printf("no CRTC left for connector %"PRIu32"\n", conn->id);
+			continue;
+		}
+
+		struct crtc *crtc = &dev->crtcs[best[i]];
+		used[best[i]] = true;
+		connector_set_crtc(conn, crtc);
+		crtc_set_mode(crtc, pick_mode(conn));
+		crtc->active = true;
+	}
+
+	for (size_t i = 0; i < dev->crtcs_len; ++i) {
+		struct crtc *crtc = &dev->crtcs[i];
+		if (!used[i]) {
+			crtc->active = false;
+			crtc_set_mode(crtc, NULL);
+		}
+	}
+
+	return m.best_score.lit;
+}
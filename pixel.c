@@ -0,0 +1,506 @@
+#include <string.h>
+
+#include "pixel.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+// Rounded x / 255, exact for x <= 255 * 255
+static inline uint32_t div255(uint32_t x) {
+	x += 128;
+	return (x + (x >> 8)) >> 8;
+}
+
+static inline uint32_t blend_pixel(uint32_t src, uint32_t dst, uint32_t alpha) {
+	uint32_t inv = 255 - div255((src >> 24) * alpha);
+
+	uint32_t out = 0;
+	for (int shift = 0; shift < 32; shift += 8) {
+		uint32_t c = div255(((src >> shift) & 0xFF) * alpha) +
+			div255(((dst >> shift) & 0xFF) * inv);
+		if (c > 0xFF) {
+			c = 0xFF;
+		}
+		out |= c << shift;
+	}
+	return out;
+}
+
+static void scalar_fill(void *dst, uint32_t dst_stride, uint32_t width,
+		uint32_t height, uint32_t color) {
+	for (uint32_t y = 0; y < height; ++y) {
+		uint32_t *row = (uint32_t *)((uint8_t *)dst + (size_t)dst_stride * y);
+		for (uint32_t x = 0; x < width; ++x) {
+			row[x] = color;
+		}
+	}
+}
+
+static void scalar_copy(void *dst, uint32_t dst_stride, const void *src,
+		uint32_t src_stride, uint32_t width, uint32_t height) {
+	for (uint32_t y = 0; y < height; ++y) {
+		memcpy((uint8_t *)dst + (size_t)dst_stride * y,
+			(const uint8_t *)src + (size_t)src_stride * y, width * 4);
+	}
+}
+
+// src_or is OR'ed into source pixels, 0xFF000000 makes them opaque
+static inline void scalar_blend_or(void *dst, uint32_t dst_stride,
+		const void *src, uint32_t src_stride, uint32_t width, uint32_t height,
+		uint8_t alpha, uint32_t src_or) {
+	for (uint32_t y = 0; y < height; ++y) {
+		uint32_t *dst_row =
+			(uint32_t *)((uint8_t *)dst + (size_t)dst_stride * y);
+		const uint32_t *src_row =
+			(const uint32_t *)((const uint8_t *)src + (size_t)src_stride * y);
+		for (uint32_t x = 0; x < width; ++x) {
+			dst_row[x] = blend_pixel(src_row[x] | src_or, dst_row[x], alpha);
+		}
+	}
+}
+
+static void scalar_blend(void *dst, uint32_t dst_stride, const void *src,
+		uint32_t src_stride, uint32_t width, uint32_t height, uint8_t alpha) {
+	scalar_blend_or(dst, dst_stride, src, src_stride, width, height, alpha, 0);
+}
+
+static void scalar_blend_opaque(void *dst, uint32_t dst_stride,
+		const void *src, uint32_t src_stride, uint32_t width, uint32_t height,
+		uint8_t alpha) {
+	scalar_blend_or(dst, dst_stride, src, src_stride, width, height, alpha,
+		0xFF000000);
+}
+
+static const struct pixel_impl scalar_impl = {
+	.name = "scalar",
+	.fill = scalar_fill,
+	.copy = scalar_copy,
+	.copy_stream = scalar_copy,
+	.blend = scalar_blend,
+	.blend_opaque = scalar_blend_opaque,
+};
+
+#ifdef HAVE_X86
+__attribute__((target("sse2")))
+static void sse2_fill(void *dst, uint32_t dst_stride, uint32_t width,
+		uint32_t height, uint32_t color) {
+	__m128i v = _mm_set1_epi32(color);
+	for (uint32_t y = 0; y < height; ++y) {
+		uint32_t *row = (uint32_t *)((uint8_t *)dst + (size_t)dst_stride * y);
+		uint32_t x = 0;
+		for (; x + 4 <= width; x += 4) {
+			_mm_storeu_si128((__m128i *)&row[x], v);
+		}
+		for (; x < width; ++x) {
+			row[x] = color;
+		}
+	}
+}
+
+__attribute__((target("sse2")))
+static void sse2_copy(void *dst, uint32_t dst_stride, const void *src,
+		uint32_t src_stride, uint32_t width, uint32_t height) {
+	for (uint32_t y = 0; y < height; ++y) {
+		uint32_t *dst_row =
+			(uint32_t *)((uint8_t *)dst + (size_t)dst_stride * y);
+		const uint32_t *src_row =
+			(const uint32_t *)((const uint8_t *)src + (size_t)src_stride * y);
+		uint32_t x = 0;
+		for (; x + 4 <= width; x += 4) {
+			__m128i v = _mm_loadu_si128((const __m128i *)&src_row[x]);
+			_mm_storeu_si128((__m128i *)&dst_row[x], v);
+		}
+		for (; x < width; ++x) {
+			dst_row[x] = src_row[x];
+		}
+	}
+}
+
+__attribute__((target("sse2")))
+static void sse2_copy_stream(void *dst, uint32_t dst_stride, const void *src,
+		uint32_t src_stride, uint32_t width, uint32_t height) {
+	for (uint32_t y = 0; y < height; ++y) {
+		uint32_t *dst_row =
+			(uint32_t *)((uint8_t *)dst + (size_t)dst_stride * y);
+		const uint32_t *src_row =
+			(const uint32_t *)((const uint8_t *)src + (size_t)src_stride * y);
+		uint32_t x = 0;
+		// Streaming stores need an aligned destination
+		for (; x < width && ((uintptr_t)&dst_row[x] & 15) != 0; ++x) {
+			dst_row[x] = src_row[x];
+		}
+		for (; x + 4 <= width; x += 4) {
+			__m128i v = _mm_loadu_si128((const __m128i *)&src_row[x]);
+			_mm_stream_si128((__m128i *)&dst_row[x], v);
+		}
+		for (; x < width; ++x) {
+			dst_row[x] = src_row[x];
+		}
+	}
+	_mm_sfence();
+}
+
+__attribute__((target("sse2")))
+static inline __m128i sse2_div255(__m128i x) {
+	x = _mm_add_epi16(x, _mm_set1_epi16(128));
+	return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+// Blends two pixels unpacked to 16 bits per channel
+__attribute__((target("sse2")))
+static inline __m128i sse2_blend_epu16(__m128i src, __m128i dst, __m128i alpha) {
+	src = sse2_div255(_mm_mullo_epi16(src, alpha));
+	__m128i src_alpha = _mm_shufflehi_epi16(
+		_mm_shufflelo_epi16(src, _MM_SHUFFLE(3, 3, 3, 3)),
+		_MM_SHUFFLE(3, 3, 3, 3));
+	__m128i inv = _mm_sub_epi16(_mm_set1_epi16(0xFF), src_alpha);
+	dst = sse2_div255(_mm_mullo_epi16(dst, inv));
+	return _mm_adds_epu16(src, dst);
+}
+
+__attribute__((target("sse2")))
+static inline void sse2_blend_or(void *dst, uint32_t dst_stride,
+		const void *src, uint32_t src_stride, uint32_t width, uint32_t height,
+		uint8_t alpha, uint32_t src_or) {
+	__m128i zero = _mm_setzero_si128();
+	__m128i a = _mm_set1_epi16(alpha);
+	__m128i mask = _mm_set1_epi32(src_or);
+	for (uint32_t y = 0; y < height; ++y) {
+		uint32_t *dst_row =
+			(uint32_t *)((uint8_t *)dst + (size_t)dst_stride * y);
+		const uint32_t *src_row =
+			(const uint32_t *)((const uint8_t *)src + (size_t)src_stride * y);
+		uint32_t x = 0;
+		for (; x + 4 <= width; x += 4) {
+			__m128i s = _mm_or_si128(
+				_mm_loadu_si128((const __m128i *)&src_row[x]), mask);
+			__m128i d = _mm_loadu_si128((const __m128i *)&dst_row[x]);
+			__m128i lo = sse2_blend_epu16(_mm_unpacklo_epi8(s, zero),
+				_mm_unpacklo_epi8(d, zero), a);
+			__m128i hi = sse2_blend_epu16(_mm_unpackhi_epi8(s, zero),
+				_mm_unpackhi_epi8(d, zero), a);
+			_mm_storeu_si128((__m128i *)&dst_row[x], _mm_packus_epi16(lo, hi));
+		}
+		for (; x < width; ++x) {
+			dst_row[x] = blend_pixel(src_row[x] | src_or, dst_row[x], alpha);
+		}
+	}
+}
+
+__attribute__((target("sse2")))
+static void sse2_blend(void *dst, uint32_t dst_stride, const void *src,
+		uint32_t src_stride, uint32_t width, uint32_t height, uint8_t alpha) {
+	sse2_blend_or(dst, dst_stride, src, src_stride, width, height, alpha, 0);
+}
+
+__attribute__((target("sse2")))
+static void sse2_blend_opaque(void *dst, uint32_t dst_stride, const void *src,
+		uint32_t src_stride, uint32_t width, uint32_t height, uint8_t alpha) {
+	sse2_blend_or(dst, dst_stride, src, src_stride, width, height, alpha,
+		0xFF000000);
+}
+
+static const struct pixel_impl sse2_impl = {
+	.name = "sse2",
+	.fill = sse2_fill,
+	.copy = sse2_copy,
+	.copy_stream = sse2_copy_stream,
+	.blend = sse2_blend,
+	.blend_opaque = sse2_blend_opaque,
+};
+
+__attribute__((target("avx2")))
+static void avx2_fill(void *dst, uint32_t dst_stride, uint32_t width,
+		uint32_t height, uint32_t color) {
+	__m256i v = _mm256_set1_epi32(color);
+	for (uint32_t y = 0; y < height; ++y) {
+		uint32_t *row = (uint32_t *)((uint8_t *)dst + (size_t)dst_stride * y);
+		uint32_t x = 0;
+		for (; x + 8 <= width; x += 8) {
+			_mm256_storeu_si256((__m256i *)&row[x], v);
+		}
+		for (; x < width; ++x) {
+			row[x] = color;
+		}
+	}
+}
+
+__attribute__((target("avx2")))
+static void avx2_copy(void *dst, uint32_t dst_stride, const void *src,
+		uint32_t src_stride, uint32_t width, uint32_t height) {
+	for (uint32_t y = 0; y < height; ++y) {
+		uint32_t *dst_row =
+			(uint32_t *)((uint8_t *)dst + (size_t)dst_stride * y);
+		const uint32_t *src_row =
+			(const uint32_t *)((const uint8_t *)src + (size_t)src_stride * y);
+		uint32_t x = 0;
+		for (; x + 8 <= width; x += 8) {
+			__m256i v = _mm256_loadu_si256((const __m256i *)&src_row[x]);
+			_mm256_storeu_si256((__m256i *)&dst_row[x], v);
+		}
+		for (; x < width; ++x) {
+			dst_row[x] = src_row[x];
+		}
+	}
+}
+
+__attribute__((target("avx2")))
+static void avx2_copy_stream(void *dst, uint32_t dst_stride, const void *src,
+		uint32_t src_stride, uint32_t width, uint32_t height) {
+	for (uint32_t y = 0; y < height; ++y) {
+		uint32_t *dst_row =
+			(uint32_t *)((uint8_t *)dst + (size_t)dst_stride * y);
+		const uint32_t *src_row =
+			(const uint32_t *)((const uint8_t *)src + (size_t)src_stride * y);
+		uint32_t x = 0;
+		for (; x < width && ((uintptr_t)&dst_row[x] & 31) != 0; ++x) {
+			dst_row[x] = src_row[x];
+		}
+		for (; x + 8 <= width; x += 8) {
+			__m256i v = _mm256_loadu_si256((const __m256i *)&src_row[x]);
+			_mm256_stream_si256((__m256i *)&dst_row[x], v);
+		}
+		for (; x < width; ++x) {
+			dst_row[x] = src_row[x];
+		}
+	}
+	_mm_sfence();
+}
+
+__attribute__((target("avx2")))
+static inline __m256i avx2_div255(__m256i x) {
+	x = _mm256_add_epi16(x, _mm256_set1_epi16(128));
+	return _mm256_srli_epi16(_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)), 8);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i avx2_blend_epu16(__m256i src, __m256i dst,
+		__m256i alpha) {
+	src = avx2_div255(_mm256_mullo_epi16(src, alpha));
+	__m256i src_alpha = _mm256_shufflehi_epi16(
+		_mm256_shufflelo_epi16(src, _MM_SHUFFLE(3, 3, 3, 3)),
+		_MM_SHUFFLE(3, 3, 3, 3));
+	__m256i inv = _mm256_sub_epi16(_mm256_set1_epi16(0xFF), src_alpha);
+	dst = avx2_div255(_mm256_mullo_epi16(dst, inv));
+	return _mm256_adds_epu16(src, dst);
+}
+
+__attribute__((target("avx2")))
+static inline void avx2_blend_or(void *dst, uint32_t dst_stride,
+		const void *src, uint32_t src_stride, uint32_t width, uint32_t height,
+		uint8_t alpha, uint32_t src_or) {
+	__m256i zero = _mm256_setzero_si256();
+	__m256i a = _mm256_set1_epi16(alpha);
+	__m256i mask = _mm256_set1_epi32(src_or);
+	for (uint32_t y = 0; y < height; ++y) {
+		uint32_t *dst_row =
+			(uint32_t *)((uint8_t *)dst + (size_t)dst_stride * y);
+		const uint32_t *src_row =
+			(const uint32_t *)((const uint8_t *)src + (size_t)src_stride * y);
+		uint32_t x = 0;
+		for (; x + 8 <= width; x += 8) {
+			__m256i s = _mm256_or_si256(
+				_mm256_loadu_si256((const __m256i *)&src_row[x]), mask);
+			__m256i d = _mm256_loadu_si256((const __m256i *)&dst_row[x]);
+			// Unpacking and packing both work per 128-bit lane, so the pixel
+			// order is preserved
+			__m256i lo = avx2_blend_epu16(_mm256_unpacklo_epi8(s, zero),
+				_mm256_unpacklo_epi8(d, zero), a);
+			__m256i hi = avx2_blend_epu16(_mm256_unpackhi_epi8(s, zero),
+				_mm256_unpackhi_epi8(d, zero), a);
+			_mm256_storeu_si256((__m256i *)&dst_row[x],
+				_mm256_packus_epi16(lo, hi));
+		}
+		for (; x < width; ++x) {
+			dst_row[x] = blend_pixel(src_row[x] | src_or, dst_row[x], alpha);
+		}
+	}
+}
+
+__attribute__((target("avx2")))
+static void avx2_blend(void *dst, uint32_t dst_stride, const void *src,
+		uint32_t src_stride, uint32_t width, uint32_t height, uint8_t alpha) {
+	avx2_blend_or(dst, dst_stride, src, src_stride, width, height, alpha, 0);
+}
+
+__attribute__((target("avx2")))
+static void avx2_blend_opaque(void *dst, uint32_t dst_stride, const void *src,
+		uint32_t src_stride, uint32_t width, uint32_t height, uint8_t alpha) {
+	avx2_blend_or(dst, dst_stride, src, src_stride, width, height, alpha,
+		0xFF000000);
+}
+
+static const struct pixel_impl avx2_impl = {
+	.name = "avx2",
+	.fill = avx2_fill,
+	.copy = avx2_copy,
+	.copy_stream = avx2_copy_stream,
+	.blend = avx2_blend,
+	.blend_opaque = avx2_blend_opaque,
+};
+#endif
+
+#ifdef __ARM_NEON
+static void neon_fill(void *dst, uint32_t dst_stride, uint32_t width,
+		uint32_t height, uint32_t color) {
+	uint32x4_t v = vdupq_n_u32(color);
+	for (uint32_t y = 0; y < height; ++y) {
+		uint32_t *row = (uint32_t *)((uint8_t *)dst + (size_t)dst_stride * y);
+		uint32_t x = 0;
+		for (; x + 4 <= width; x += 4) {
+			vst1q_u32(&row[x], v);
+		}
+		for (; x < width; ++x) {
+			row[x] = color;
+		}
+	}
+}
+
+static void neon_copy(void *dst, uint32_t dst_stride, const void *src,
+		uint32_t src_stride, uint32_t width, uint32_t height) {
+	for (uint32_t y = 0; y < height; ++y) {
+		uint32_t *dst_row =
+			(uint32_t *)((uint8_t *)dst + (size_t)dst_stride * y);
+		const uint32_t *src_row =
+			(const uint32_t *)((const uint8_t *)src + (size_t)src_stride * y);
+		uint32_t x = 0;
+		for (; x + 4 <= width; x += 4) {
+			vst1q_u32(&dst_row[x], vld1q_u32(&src_row[x]));
+		}
+		for (; x < width; ++x) {
+			dst_row[x] = src_row[x];
+		}
+	}
+}
+
+// Same rounding as div255
+static inline uint8x8_t neon_div255(uint16x8_t x) {
+	return vrshrn_n_u16(vrsraq_n_u16(x, x, 8), 8);
+}
+
+static inline void neon_blend_or(void *dst, uint32_t dst_stride,
+		const void *src, uint32_t src_stride, uint32_t width, uint32_t height,
+		uint8_t alpha, uint32_t src_or) {
+	uint8x8_t a = vdup_n_u8(alpha);
+	uint8x8_t a_or = vdup_n_u8(src_or >> 24);
+	for (uint32_t y = 0; y < height; ++y) {
+		uint32_t *dst_row =
+			(uint32_t *)((uint8_t *)dst + (size_t)dst_stride * y);
+		const uint32_t *src_row =
+			(const uint32_t *)((const uint8_t *)src + (size_t)src_stride * y);
+		uint32_t x = 0;
+		for (; x + 8 <= width; x += 8) {
+			// De-interleaved into B, G, R, A
+			uint8x8x4_t s = vld4_u8((const uint8_t *)&src_row[x]);
+			s.val[3] = vorr_u8(s.val[3], a_or);
+			uint8x8x4_t d = vld4_u8((const uint8_t *)&dst_row[x]);
+			for (int c = 0; c < 4; ++c) {
+				s.val[c] = neon_div255(vmull_u8(s.val[c], a));
+			}
+			uint8x8_t inv = vmvn_u8(s.val[3]);
+			for (int c = 0; c < 4; ++c) {
+				d.val[c] = vqadd_u8(s.val[c],
+					neon_div255(vmull_u8(d.val[c], inv)));
+			}
+			vst4_u8((uint8_t *)&dst_row[x], d);
+		}
+		for (; x < width; ++x) {
+			dst_row[x] = blend_pixel(src_row[x] | src_or, dst_row[x], alpha);
+		}
+	}
+}
+
+static void neon_blend(void *dst, uint32_t dst_stride, const void *src,
+		uint32_t src_stride, uint32_t width, uint32_t height, uint8_t alpha) {
+	neon_blend_or(dst, dst_stride, src, src_stride, width, height, alpha, 0);
+}
+
+static void neon_blend_opaque(void *dst, uint32_t dst_stride, const void *src,
+		uint32_t src_stride, uint32_t width, uint32_t height, uint8_t alpha) {
+	neon_blend_or(dst, dst_stride, src, src_stride, width, height, alpha,
+		0xFF000000);
+}
+
+static const struct pixel_impl neon_impl = {
+	.name = "neon",
+	.fill = neon_fill,
+	.copy = neon_copy,
+	// There are no non-temporal store intrinsics, full 16-byte stores are the
+	// next best thing for write-combining
+	.copy_stream = neon_copy,
+	.blend = neon_blend,
+	.blend_opaque = neon_blend_opaque,
+};
+#endif
+
+size_t pixel_get_impls(const struct pixel_impl **impls, size_t impls_cap) {
+	const struct pixel_impl *supported[4];
+	size_t n = 0;
+
+	supported[n++] = &scalar_impl;
+#ifdef HAVE_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2")) {
+		supported[n++] = &sse2_impl;
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		supported[n++] = &avx2_impl;
+	}
+#endif
+#ifdef __ARM_NEON
+	// Always available when the compiler is allowed to use it
+	supported[n++] = &neon_impl;
+#endif
+
+	if (n > impls_cap) {
+		n = impls_cap;
+	}
+	memcpy(impls, supported, n * sizeof(supported[0]));
+	return n;
+}
+
+static const struct pixel_impl *best_impl = &scalar_impl;
+
+// Runs before main, so that no locking is needed when rendering from threads
+__attribute__((constructor))
+static void select_impl(void) {
+	const struct pixel_impl *impls[4];
+	size_t n = pixel_get_impls(impls, 4);
+	best_impl = impls[n - 1];
+}
+
+const struct pixel_impl *pixel_get_impl(void) {
+	return best_impl;
+}
+
+void pixel_fill(void *dst, uint32_t dst_stride, uint32_t width,
+		uint32_t height, uint32_t color) {
+	best_impl->fill(dst, dst_stride, width, height, color);
+}
+
+void pixel_copy(void *dst, uint32_t dst_stride, const void *src,
+		uint32_t src_stride, uint32_t width, uint32_t height) {
+	best_impl->copy(dst, dst_stride, src, src_stride, width, height);
+}
+
+void pixel_copy_stream(void *dst, uint32_t dst_stride, const void *src,
+		uint32_t src_stride, uint32_t width, uint32_t height) {
+	best_impl->copy_stream(dst, dst_stride, src, src_stride, width, height);
+}
+
+void pixel_blend(void *dst, uint32_t dst_stride, const void *src,
+		uint32_t src_stride, uint32_t width, uint32_t height, uint8_t alpha) {
+	best_impl->blend(dst, dst_stride, src, src_stride, width, height, alpha);
+}
+
+void pixel_blend_opaque(void *dst, uint32_t dst_stride, const void *src,
+		uint32_t src_stride, uint32_t width, uint32_t height, uint8_t alpha) {
+	best_impl->blend_opaque(dst, dst_stride, src, src_stride, width, height,
+		alpha);
+}
@@ -1,6 +1,6 @@
 #include <inttypes.h>
-#include <poll.h>
 #include <stdlib.h>
+#include <sys/epoll.h>
 #include <sys/mman.h>
 #include <time.h>
 
@@ -8,53 +8,14 @@
 #include <xf86drm.h>
 
 #include "dp.h"
+#include "pixel.h"
+#include "thread_pool.h"
 #include "util.h"
 
 #include <stdio.h>
 
 static bool running = true;
 
-// Pick the CRTC with the maximum number of planes
-static void pick_crtc(struct connector *conn) {
-	struct device *dev = conn->dev;
-
-	size_t planes_per_crtc[dev->crtcs_len + 1];
-	memset(planes_per_crtc, 0, sizeof(planes_per_crtc));
-
-	size_t best_crtc = 0;
-	for (size_t i = 0; i < dev->planes_len; ++i) {
-		struct plane *plane = &dev->planes[i];
-		for (size_t j = 0; j < dev->crtcs_len; ++j) {
-			if ((conn->possible_crtcs & (1 << j)) == 0) {
-				continue;
-			}
-			if (plane->possible_crtcs & (1 << j)) {
-				++planes_per_crtc[j];
-				if (planes_per_crtc[j] > planes_per_crtc[best_crtc]) {
-					best_crtc = j;
-				}
-			}
-		}
-	}
-
-	connector_set_crtc(conn, &dev->crtcs[best_crtc]);
-}
-
-// Pick the preferred mode
-static void pick_mode(struct connector *conn) {
-	if (conn->modes_len == 0) {
-		fatal("connector %"PRIu32" has no mode", conn->id);
-	}
-	drmModeModeInfo *mode = &conn->modes[0];
-	for (size_t i = 0; i < conn->modes_len; ++i) {
-		if (conn->modes[i].flags & DRM_MODE_TYPE_PREFERRED) {
-			mode = &conn->modes[i];
-			break;
-		}
-	}
-	crtc_set_mode(conn->crtc, mode);
-}
-
 static uint32_t pick_rgb_format(struct plane *plane) {
 	uint32_t fb_fmt = DRM_FORMAT_INVALID;
 
@@ -74,194 +35,447 @@ static uint32_t pick_rgb_format(struct plane *plane) {
 }
 
 static const int timeout_sec = 5;
-static int n_page_flips = 0;
-static bool to_right = true;
+static const size_t swapchain_len = 3;
+
+static const uint64_t repaint_margin_ns = 2000000;
+
+// B G R
+static const uint8_t colors[][3] = {
+	{ 0xFF, 0x00, 0x00 },
+	{ 0x00, 0xFF, 0x00 },
+	{ 0x00, 0x00, 0xFF },
+};
+static const size_t colors_len = sizeof(colors) / sizeof(colors[0]);
+
+static const uint32_t box_size = 100;
+static const uint32_t square_size = 100;
+
+// A full-screen background with a moving box, and moving squares on top. The
+// layers go on planes when possible, and are composited into the primary
+// plane's framebuffer otherwise.
+#define SQUARES_LEN 3
+#define LAYERS_LEN (1 + SQUARES_LEN)
+
+// Each output is animated independently, at the pace of its own CRTC
+struct output {
+	struct crtc *crtc;
+	struct repaint_scheduler scheduler;
+	struct event_source *timer_source;
+	struct plane_alloc alloc;
+
+	struct layer layers[LAYERS_LEN];
+	struct swapchain swapchains[LAYERS_LEN];
+	struct rect layer_damage[LAYERS_LEN]; // in CRTC coordinates
+
+	struct swapchain composite; // on the primary plane
+	size_t composited;
+	struct plane *layer_planes[LAYERS_LEN]; // in the previous frame
+
+	struct cursor cursor;
+	bool has_cursor;
+	struct framebuffer_dumb cursor_fb;
+
+	int n_page_flips;
+	bool to_right;
+	bool done;
+	struct rect box; // moving box drawn on the background
+};
+
+static struct output *outputs = NULL;
+static size_t outputs_len = 0;
+static size_t outputs_done = 0;
+
+static struct thread_pool pool = { 0 };
+static struct compositor compositor = { 0 };
+
+static void fill_rect(struct framebuffer_dumb *fb, void *data,
+		const struct rect *rect, uint32_t color) {
+	uint8_t *dst = (uint8_t *)data + fb->stride * rect->y + rect->x * 4;
+	pixel_fill(dst, fb->stride, rect->width, rect->height, color);
+	framebuffer_dumb_damage_rows(fb, rect->y, rect->height);
+}
 
-static void handle_page_flip(int drm_fd, unsigned sequence, unsigned tv_sec,
-		unsigned tv_usec, void *data) {
-	struct connector *conn = data;
-	struct device *dev = conn->dev;
+// Adds the changed region, in CRTC coordinates, to damage
+static void render_layer(struct output *out, size_t idx, struct rect *damage) {
+	struct layer *layer = &out->layers[idx];
+	struct swapchain *sc = &out->swapchains[idx];
 
-	++n_page_flips;
-	if (n_page_flips > 60 * timeout_sec) {
-		running = false;
+	struct framebuffer_dumb *fb = swapchain_acquire(sc);
+	if (fb == NULL) {
+		// All buffers are busy, keep the previous contents
 		return;
 	}
 
-	if (n_page_flips % 60 == 0) {
-		to_right = !to_right;
+	// Only the old and new positions of the box change
+	bool has_box = idx == 0 &&
+		fb->fb.width > box_size && fb->fb.height > box_size;
+	if (has_box) {
+		struct rect new_box = {
+			.x = (out->n_page_flips * 4) % (fb->fb.width - box_size),
+			.y = (fb->fb.height - box_size) / 2,
+			.width = box_size,
+			.height = box_size,
+		};
+		swapchain_add_damage(sc, &out->box);
+		swapchain_add_damage(sc, &new_box);
+		out->box = new_box;
 	}
 
-	int delta = to_right ? 1 : -1;
-	int x = 0;
-	for (size_t j = 0; j < dev->planes_len; ++j) {
-		struct plane *plane = &dev->planes[j];
-		if (plane->crtc != conn->crtc) {
-			continue;
+	struct rect changed = sc->damage;
+	changed.x += layer->x;
+	changed.y += layer->y;
+	rect_union(damage, &changed);
+
+	// Repaint what changed since this buffer was last displayed
+	struct rect repaint;
+	swapchain_get_repaint(sc, fb, &repaint);
+
+	if (!rect_empty(&repaint)) {
+		void *data = NULL;
+		framebuffer_dumb_map(fb, PROT_WRITE, &data);
+
+		const uint8_t *color = colors[idx % colors_len];
+		uint32_t argb = 0x80u << 24 | color[2] << 16 | color[1] << 8 | color[0];
+		if (idx == 0) {
+			argb = 0xFFu << 24 | color[2] << 16 | color[1] << 8 | color[0];
 		}
+		fill_rect(fb, data, &repaint, argb);
 
-		if (plane->type != DRM_PLANE_TYPE_PRIMARY) {
-			x += delta;
-			plane->x += x;
-			plane->y += delta;
+		struct rect box_repaint;
+		if (has_box && rect_intersect(&box_repaint, &out->box, &repaint)) {
+			fill_rect(fb, data, &box_repaint, 0xFFFFFFFF);
 		}
+
+		framebuffer_dumb_unmap(fb, data);
 	}
 
-	crtc_commit(conn->crtc,
-		DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_NONBLOCK, conn);
+	swapchain_queue(sc, fb);
+	layer->fb = &fb->fb;
 }
 
-int main(int argc, char *argv[]) {
-	const char *device_path = "/dev/dri/card0";
-	if (argc == 2) {
-		device_path = argv[1];
+// Recomposites the layers which didn't get a plane, if any
+static void composite(struct output *out, struct framebuffer_dumb *fb) {
+	size_t composited = plane_alloc_assign(&out->alloc, out->layers,
+		LAYERS_LEN, &fb->fb);
+
+	bool changed = composited != out->composited;
+	for (size_t i = 0; i < LAYERS_LEN; ++i) {
+		changed = changed || out->layers[i].plane != out->layer_planes[i];
+		out->layer_planes[i] = out->layers[i].plane;
 	}
+	out->composited = composited;
 
-	struct device dev = { 0 };
-	device_init(&dev, device_path);
+	if (composited == 0) {
+		swapchain_release(&out->composite, fb);
+		return;
+	}
 
-	if (dev.connectors_len == 0) {
-		fatal("no connector");
+	struct rect damage = { 0 };
+	if (changed) {
+		damage = (struct rect){ 0, 0, fb->fb.width, fb->fb.height };
 	}
-	if (dev.crtcs_len == 0) {
-		fatal("no CRTC");
+	for (size_t i = 0; i < composited; ++i) {
+		rect_union(&damage, &out->layer_damage[i]);
 	}
+	swapchain_add_damage(&out->composite, &damage);
+
+	struct rect repaint;
+	swapchain_get_repaint(&out->composite, fb, &repaint);
+	compositor_composite(&compositor, fb, out->layers, composited, &repaint);
+
+	swapchain_queue(&out->composite, fb);
+}
 
-	struct connector *conn = NULL;
-	for (size_t i = 0; i < dev.connectors_len; ++i) {
-		if (dev.connectors[i].state == DRM_MODE_CONNECTED && conn == NULL) {
-			conn = &dev.connectors[i];
-		} else {
-			connector_set_crtc(&dev.connectors[i], NULL);
+static void repaint(struct output *out) {
+	struct framebuffer_dumb *composite_fb = swapchain_acquire(&out->composite);
+	if (composite_fb == NULL) {
+		// Skip the frame. Nothing is committed, so no page-flip is coming to
+		// schedule the next repaint: try again for the following vblank.
+		repaint_scheduler_schedule(&out->scheduler);
+		return;
+	}
+
+	if (out->n_page_flips % 60 == 0) {
+		out->to_right = !out->to_right;
+	}
+
+	int delta = out->to_right ? 1 : -1;
+	for (size_t i = 0; i < LAYERS_LEN; ++i) {
+		struct layer *layer = &out->layers[i];
+		struct rect *damage = &out->layer_damage[i];
+		*damage = (struct rect){ 0 };
+
+		// Both the old and new positions of squares need to be recomposited
+		if (i > 0) {
+			*damage = (struct rect){ layer->x, layer->y,
+				layer->width, layer->height };
+			layer->x += i * delta;
+			layer->y += delta;
+			rect_union(damage, &(struct rect){ layer->x, layer->y,
+				layer->width, layer->height });
 		}
+
+		render_layer(out, i, damage);
 	}
-	if (conn == NULL) {
-		fatal("failed to find a connected connector");
+
+	composite(out, composite_fb);
+
+	// The cursor update is merged into the commit of the frame
+	if (out->has_cursor) {
+		// The cursor may be as large as the mode
+		uint32_t hdisplay = out->crtc->mode->hdisplay;
+		uint32_t vdisplay = out->crtc->mode->vdisplay;
+		uint32_t width = out->cursor_fb.fb.width;
+		uint32_t height = out->cursor_fb.fb.height;
+		uint32_t range_x = hdisplay > width ? hdisplay - width : 1;
+		uint32_t range_y = vdisplay > height ? vdisplay - height : 1;
+		cursor_move(&out->cursor, (out->n_page_flips * 8) % range_x,
+			(out->n_page_flips * 4) % range_y);
 	}
 
-	pick_crtc(conn);
-	pick_mode(conn);
+	// Outputs repainted in the same wakeup are committed together
+	crtc_request_commit(out->crtc);
 
-	for (size_t i = 0; i < dev.crtcs_len; ++i) {
-		struct crtc *crtc = &dev.crtcs[i];
-		crtc->active = (conn->crtc == crtc);
-		if (!crtc->active) {
-			crtc_set_mode(crtc, NULL);
-		}
+	repaint_scheduler_render_done(&out->scheduler);
+}
+
+static void handle_repaint_timer(struct event_source *source, uint32_t events,
+		void *data) {
+	struct output *out = data;
+
+	if (repaint_scheduler_dispatch(&out->scheduler)) {
+		repaint(out);
 	}
+}
 
-	device_commit(&dev, DRM_MODE_ATOMIC_ALLOW_MODESET);
+static void handle_commit(struct crtc *crtc, int status, void *data) {
+	struct output *out = data;
 
-	struct framebuffer_dumb fbs[dev.planes_len + 1];
-	size_t fbs_len = 0;
+	if (status != 0) {
+		// The plane assignment may be what the driver didn't like: search
+		// again and retry with the next frame
+		fprintf(stderr, "commit failed on CRTC %"PRIu32": %s\n", crtc->id,
+			strerror(-status));
+		plane_alloc_handle_commit_failure(&out->alloc);
+		repaint_scheduler_schedule(&out->scheduler);
+		return;
+	}
 
-	for (size_t i = 0; i < dev.planes_len; ++i) {
-		struct plane *plane = &dev.planes[i];
+	for (size_t i = 0; i < LAYERS_LEN; ++i) {
+		swapchain_handle_commit(&out->swapchains[i]);
+	}
+	swapchain_handle_commit(&out->composite);
+}
 
-		switch (plane->type) {
-		case DRM_PLANE_TYPE_OVERLAY:
-			plane->width = plane->height = 100;
-			break;
-		case DRM_PLANE_TYPE_PRIMARY:
-			plane->width = conn->crtc->mode->hdisplay;
-			plane->height = conn->crtc->mode->vdisplay;
-			break;
-		case DRM_PLANE_TYPE_CURSOR:
-			// Some drivers *require* the FB to have exactly this size
-			plane->width = dev.caps.cursor_width;
-			plane->height = dev.caps.cursor_height;
-			break;
-		}
+static void handle_page_flip(struct crtc *crtc, void *data) {
+	struct output *out = data;
 
-		uint32_t fb_fmt = pick_rgb_format(plane);
-		if (fb_fmt == DRM_FORMAT_INVALID) {
-			continue;
-		}
+	for (size_t i = 0; i < LAYERS_LEN; ++i) {
+		swapchain_handle_page_flip(&out->swapchains[i]);
+	}
+	swapchain_handle_page_flip(&out->composite);
 
-		if (!plane_set_crtc(plane, conn->crtc)) {
-			plane_set_crtc(plane, NULL);
-			continue;
-		}
+	if (out->done) {
+		return;
+	}
 
-		struct framebuffer_dumb *fb = &fbs[fbs_len];
-		framebuffer_dumb_init(fb, &dev, fb_fmt, plane->width, plane->height);
-		++fbs_len;
+	++out->n_page_flips;
+	if (out->n_page_flips > 60 * timeout_sec) {
+		out->done = true;
+		++outputs_done;
+		running = outputs_done < outputs_len;
+		return;
+	}
 
-		plane_set_framebuffer(plane, &fb->fb);
+	// Render the next frame right before the next vblank
+	repaint_scheduler_handle_page_flip(&out->scheduler);
+}
+
+static void init_swapchain(struct swapchain *sc, struct device *dev,
+		struct plane *plane, uint32_t fmt, uint32_t width, uint32_t height) {
+	swapchain_init(sc, dev, plane, fmt, width, height, swapchain_len);
+
+	// Layers are read back by the compositor, and composited buffers are
+	// only partially updated
+	for (size_t i = 0; i < sc->buffers_len; ++i) {
+		framebuffer_dumb_enable_shadow(&sc->buffers[i].fb);
 	}
+}
+
+// A white square with a black outline, on a transparent background
+static void init_cursor(struct output *out) {
+	struct device *dev = out->crtc->dev;
+
+	if (!cursor_init(&out->cursor, out->crtc)) {
+		return;
+	}
+	out->has_cursor = true;
+
+	struct framebuffer_dumb *fb = &out->cursor_fb;
+	framebuffer_dumb_init(fb, dev, DRM_FORMAT_ARGB8888,
+		dev->caps.cursor_width, dev->caps.cursor_height);
+
+	void *data = NULL;
+	framebuffer_dumb_map(fb, PROT_WRITE, &data);
+	pixel_fill(data, fb->stride, fb->fb.width, fb->fb.height, 0x00000000);
+	uint32_t size = fb->fb.width < fb->fb.height ? fb->fb.width : fb->fb.height;
+	if (size > 24) {
+		size = 24;
+	}
+	pixel_fill(data, fb->stride, size, size, 0xFF000000);
+	pixel_fill((uint8_t *)data + fb->stride * 2 + 2 * 4, fb->stride,
+		size - 4, size - 4, 0xFFFFFFFF);
+	framebuffer_dumb_unmap(fb, data);
+
+	cursor_set_image(&out->cursor, &fb->fb);
+}
+
+static void output_init(struct output *out, struct event_loop *loop) {
+	struct device *dev = out->crtc->dev;
+	uint32_t width = out->crtc->mode->hdisplay;
+	uint32_t height = out->crtc->mode->vdisplay;
+
+	plane_alloc_init(&out->alloc, out->crtc);
 
-	// B G R
-	const uint8_t colors[][3] = {
-		{ 0xFF, 0x00, 0x00 },
-		{ 0x00, 0xFF, 0x00 },
-		{ 0x00, 0x00, 0xFF },
+	uint32_t fmt = pick_rgb_format(out->alloc.primary);
+	if (fmt == DRM_FORMAT_INVALID) {
+		fatal("primary plane %"PRIu32" doesn't support RGB formats",
+			out->alloc.primary->id);
+	}
+	init_swapchain(&out->composite, dev, out->alloc.primary, fmt,
+		width, height);
+
+	out->layers[0] = (struct layer){
+		.width = width,
+		.height = height,
+		.alpha = 1,
 	};
-	const size_t colors_len = sizeof(colors) / sizeof(colors[0]);
+	init_swapchain(&out->swapchains[0], dev, NULL, fmt, width, height);
+
+	for (size_t i = 1; i < LAYERS_LEN; ++i) {
+		out->layers[i] = (struct layer){
+			.x = 10 * i,
+			.y = 20 * i,
+			.width = square_size,
+			.height = square_size,
+			.alpha = 0.5,
+		};
+		init_swapchain(&out->swapchains[i], dev, NULL, DRM_FORMAT_ARGB8888,
+			square_size, square_size);
+	}
 
-	int x = 0;
-	for (size_t i = 0; i < dev.planes_len; ++i) {
-		struct plane *plane = &dev.planes[i];
-		if (plane->crtc != conn->crtc) {
-			continue;
-		}
+	init_cursor(out);
 
-		struct framebuffer_dumb *fb = (struct framebuffer_dumb *)plane->fb;
-		if (!fb) {
-			continue;
-		}
+	repaint_scheduler_init(&out->scheduler, out->crtc, repaint_margin_ns);
+	out->timer_source = event_loop_add_fd(loop, out->scheduler.timer_fd,
+		EPOLLIN, handle_repaint_timer, out);
 
-		if (plane->type != DRM_PLANE_TYPE_PRIMARY) {
-			x += 10;
-			plane->x = x;
-			plane->y = 2 * x;
-		}
-		plane->alpha = 0.5;
+	out->crtc->commit_handler = handle_commit;
+	out->crtc->page_flip_handler = handle_page_flip;
+	out->crtc->page_flip_data = out;
+}
 
-		void *data = NULL;
-		framebuffer_dumb_map(fb, PROT_WRITE, &data);
+static void output_finish(struct output *out) {
+	struct device *dev = out->crtc->dev;
+
+	frame_stats_print(&out->crtc->stats, out->crtc->id);
+	plane_alloc_finish(&out->alloc);
 
-		const uint8_t *color = colors[i % colors_len];
-		for (uint32_t y = 0; y < fb->fb.height; ++y) {
-			uint8_t *row = (uint8_t *)data + fb->stride * y;
+	event_source_remove(out->timer_source);
+	repaint_scheduler_finish(&out->scheduler);
 
-			for (uint32_t x = 0; x < fb->fb.width; ++x) {
-				row[x * 4 + 0] = color[0];
-				row[x * 4 + 1] = color[1];
-				row[x * 4 + 2] = color[2];
-				row[x * 4 + 3] = 0x80;
-			}
+	for (size_t i = 0; i < dev->planes_len; ++i) {
+		struct plane *plane = &dev->planes[i];
+		if (plane->crtc == out->crtc) {
+			plane_set_framebuffer(plane, NULL);
 		}
+	}
 
-		framebuffer_dumb_unmap(fb, data);
+	for (size_t i = 0; i < LAYERS_LEN; ++i) {
+		swapchain_finish(&out->swapchains[i]);
 	}
+	swapchain_finish(&out->composite);
 
-	crtc_commit(conn->crtc,
-		DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_NONBLOCK, conn);
+	if (out->has_cursor) {
+		cursor_finish(&out->cursor);
+		framebuffer_dumb_finish(&out->cursor_fb);
+	}
+}
 
-	struct pollfd pollfd = { .fd = dev.fd, .events = POLLIN };
+int main(int argc, char *argv[]) {
+	const char *device_path = "/dev/dri/card0";
+	if (argc == 2) {
+		device_path = argv[1];
+	}
 
-	while (running) {
-		int ret = poll(&pollfd, 1, timeout_sec * 1000);
-		if (ret < 0 && errno != EAGAIN) {
-			fatal("poll failed");
+	struct device dev = { 0 };
+	device_init(&dev, device_path,
+		DEVICE_INIT_FAST_PROBE | DEVICE_INIT_PARALLEL);
+
+	if (dev.connectors_len == 0) {
+		fatal("no connector");
+	}
+	if (dev.crtcs_len == 0) {
+		fatal("no CRTC");
+	}
+
+	if (device_enable_outputs(&dev) == 0) {
+		fatal("failed to enable any connected connector");
+	}
+
+	// If the modes are already set, e.g. by the firmware, the previous
+	// framebuffers stay on screen until the first frame replaces them
+	if (device_needs_modeset(&dev)) {
+		device_commit(&dev, DRM_MODE_ATOMIC_ALLOW_MODESET);
+	}
+
+	thread_pool_init(&pool, 0);
+	compositor_init(&compositor, &pool);
+
+	struct event_loop loop;
+	event_loop_init(&loop);
+	struct event_source *dev_source = event_loop_add_device(&loop, &dev);
+
+	outputs = xalloc(dev.crtcs_len * sizeof(struct output));
+	for (size_t i = 0; i < dev.crtcs_len; ++i) {
+		struct crtc *crtc = &dev.crtcs[i];
+		if (!crtc->active) {
+			continue;
 		}
 
-		if (pollfd.revents & POLLIN) {
-			drmEventContext context = {
-				.version = 2,
-				.page_flip_handler = handle_page_flip,
-			};
+		struct output *out = &outputs[outputs_len++];
+		out->crtc = crtc;
+		output_init(out, &loop);
+		repaint(out);
+	}
+
+	// The first frame of all outputs is committed at once
+	device_flush(&dev);
 
-			if (drmHandleEvent(dev.fd, &context) < 0) {
-				fatal_errno("drmHandleEvent failed");
-			}
+	int status = EXIT_SUCCESS;
+	while (running) {
+		int ret = event_loop_dispatch(&loop, timeout_sec * 1000);
+		if (ret < 0) {
+			// Still restore the outputs below
+			fprintf(stderr, "event_loop_dispatch failed: %s\n", strerror(-ret));
+			status = EXIT_FAILURE;
+			break;
 		}
 	}
 
-	for (size_t i = 0; i < fbs_len; ++i) {
-		framebuffer_dumb_finish(&fbs[i]);
+	// Hand the outputs back before destroying the framebuffers on screen
+	device_restore(&dev);
+
+	for (size_t i = 0; i < outputs_len; ++i) {
+		output_finish(&outputs[i]);
 	}
+	free(outputs);
+
+	event_source_remove(dev_source);
+	event_loop_finish(&loop);
+	compositor_finish(&compositor);
+	thread_pool_finish(&pool);
 
 	device_finish(&dev);
-	return EXIT_SUCCESS;
+	return status;
 }
@@ -0,0 +1,42 @@
+#include "dp.h"
+
+bool rect_empty(const struct rect *rect) {
+	return rect->width == 0 || rect->height == 0;
+}
+
+void rect_union(struct rect *dst, const struct rect *src) {
+	if (rect_empty(src)) {
+		return;
+	}
+	if (rect_empty(dst)) {
+		*dst = *src;
+		return;
+	}
+
+	uint32_t x1 = dst->x < src->x ? dst->x : src->x;
+	uint32_t y1 = dst->y < src->y ? dst->y : src->y;
+	uint32_t dst_x2 = dst->x + dst->width, src_x2 = src->x + src->width;
+	uint32_t dst_y2 = dst->y + dst->height, src_y2 = src->y + src->height;
+	uint32_t x2 = dst_x2 > src_x2 ? dst_x2 : src_x2;
+	uint32_t y2 = dst_y2 > src_y2 ? dst_y2 : src_y2;
+
+	*dst = (struct rect){ x1, y1, x2 - x1, y2 - y1 };
+}
+
+// Returns false if the intersection is empty
+bool rect_intersect(struct rect *dst, const struct rect *a,
+		const struct rect *b) {
+	uint32_t x1 = a->x > b->x ? a->x : b->x;
+	uint32_t y1 = a->y > b->y ? a->y : b->y;
+	uint32_t a_x2 = a->x + a->width, b_x2 = b->x + b->width;
+	uint32_t a_y2 = a->y + a->height, b_y2 = b->y + b->height;
+	uint32_t x2 = a_x2 < b_x2 ? a_x2 : b_x2;
+	uint32_t y2 = a_y2 < b_y2 ? a_y2 : b_y2;
+
+	if (x1 >= x2 || y1 >= y2) {
+		*dst = (struct rect){ 0 };
+		return false;
+	}
+	*dst = (struct rect){ x1, y1, x2 - x1, y2 - y1 };
+	return true;
+}
@@ -0,0 +1,115 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dp.h"
+#include "util.h"
+
+static uint64_t refresh_ns(struct crtc *crtc) {
+	const drmModeModeInfo *mode = crtc->mode;
+	if (mode == NULL || mode->clock == 0) {
+		return 1000000000 / 60;
+	}
+	// The clock is in kHz
+	return (uint64_t)mode->htotal * mode->vtotal * 1000000 / mode->clock;
+}
+
+void repaint_scheduler_init(struct repaint_scheduler *sched,
+		struct crtc *crtc, uint64_t margin_ns) {
+	*sched = (struct repaint_scheduler){
+		.crtc = crtc,
+		.margin_ns = margin_ns,
+	};
+
+	sched->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+		TFD_NONBLOCK | TFD_CLOEXEC);
+	if (sched->timer_fd < 0) {
+		fatal_errno("timerfd_create failed");
+	}
+}
+
+void repaint_scheduler_finish(struct repaint_scheduler *sched) {
+	printf("CRTC %"PRIu32": %"PRIu64" missed repaint deadlines, "
+		"render time %"PRIu64" us\n", sched->crtc->id,
+		sched->missed_deadlines, sched->render_ns / 1000);
+	close(sched->timer_fd);
+}
+
+// Arms the timer so that rendering finishes right before the next vblank we
+// can still make. Must be called after crtc_handle_page_flip.
+void repaint_scheduler_schedule(struct repaint_scheduler *sched) {
+	uint64_t refresh = refresh_ns(sched->crtc);
+	uint64_t budget = sched->render_ns + sched->margin_ns +
+		sched->extra_margin_ns;
+	uint64_t now = now_ns();
+
+	uint64_t vblank = sched->crtc->stats.last_flip_ns;
+	if (vblank == 0) {
+		vblank = now;
+	}
+	do {
+		vblank += refresh;
+	} while (vblank < now + budget);
+
+	sched->target_vblank_ns = vblank;
+
+	uint64_t wakeup = vblank - budget;
+	struct itimerspec spec = {
+		.it_value = {
+			.tv_sec = wakeup / 1000000000,
+			.tv_nsec = wakeup % 1000000000,
+		},
+	};
+	if (timerfd_settime(sched->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) != 0) {
+		fatal_errno("timerfd_settime failed");
+	}
+}
+
+// Must be called when the timer FD is readable. Returns true if it's time to
+// render.
+bool repaint_scheduler_dispatch(struct repaint_scheduler *sched) {
+	uint64_t expirations;
+	if (read(sched->timer_fd, &expirations, sizeof(expirations)) < 0) {
+		if (errno == EAGAIN) {
+			return false;
+		}
+		fatal_errno("failed to read timer FD");
+	}
+
+	sched->render_start_ns = now_ns();
+	return true;
+}
+
+// Must be called once the frame has been committed
+void repaint_scheduler_render_done(struct repaint_scheduler *sched) {
+	uint64_t duration = now_ns() - sched->render_start_ns;
+	if (sched->render_ns == 0) {
+		sched->render_ns = duration;
+	} else {
+		// Exponential moving average with a 1/8 weight
+		sched->render_ns = sched->render_ns - sched->render_ns / 8 +
+			duration / 8;
+	}
+}
+
+// Checks whether the last frame made its deadline, then schedules the next
+// repaint
+void repaint_scheduler_handle_page_flip(struct repaint_scheduler *sched) {
+	uint64_t refresh = refresh_ns(sched->crtc);
+	uint64_t flip_ns = sched->crtc->stats.last_flip_ns;
+
+	if (sched->target_vblank_ns != 0 &&
+			flip_ns > sched->target_vblank_ns + refresh / 2) {
+		++sched->missed_deadlines;
+		sched->extra_margin_ns += refresh / 8;
+		if (sched->extra_margin_ns > refresh / 2) {
+			sched->extra_margin_ns = refresh / 2;
+		}
+	} else {
+		sched->extra_margin_ns -= sched->extra_margin_ns / 16;
+	}
+
+	repaint_scheduler_schedule(sched);
+}
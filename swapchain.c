@@ -0,0 +1,178 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "dp.h"
+#include "util.h"
+
+// If plane is NULL, queued buffers aren't assigned to any plane
+void swapchain_init(struct swapchain *sc, struct device *dev,
+		struct plane *plane, uint32_t fmt, uint32_t width, uint32_t height,
+		size_t len) {
+	printf("initializing swapchain with %zu buffers for plane %"PRIu32"\n",
+		len, plane != NULL ? plane->id : 0);
+
+	sc->plane = plane;
+	sc->buffers_len = len;
+	sc->buffers = xalloc(len * sizeof(struct swapchain_buffer));
+	for (size_t i = 0; i < len; ++i) {
+		framebuffer_dumb_init(&sc->buffers[i].fb, dev, fmt,
+			width, height);
+	}
+}
+
+void swapchain_finish(struct swapchain *sc) {
+	for (size_t i = 0; i < sc->buffers_len; ++i) {
+		struct framebuffer_dumb *fb = &sc->buffers[i].fb;
+		if (sc->plane != NULL && sc->plane->fb == &fb->fb) {
+			plane_set_framebuffer(sc->plane, NULL);
+		}
+		framebuffer_dumb_finish(fb);
+	}
+	free(sc->buffers);
+}
+
+// Returns NULL if all buffers are in use
+struct framebuffer_dumb *swapchain_acquire(struct swapchain *sc) {
+	for (size_t i = 0; i < sc->buffers_len; ++i) {
+		struct swapchain_buffer *buf = &sc->buffers[i];
+		if (buf->state == SWAPCHAIN_BUFFER_FREE) {
+			buf->state = SWAPCHAIN_BUFFER_ACQUIRED;
+			return &buf->fb;
+		}
+	}
+	return NULL;
+}
+
+static struct swapchain_buffer *buffer_from_fb(struct swapchain *sc,
+		struct framebuffer_dumb *fb) {
+	for (size_t i = 0; i < sc->buffers_len; ++i) {
+		if (&sc->buffers[i].fb == fb) {
+			return &sc->buffers[i];
+		}
+	}
+	fatal("framebuffer %"PRIu32" doesn't belong to the swapchain", fb->fb.id);
+}
+
+// Assigns the buffer to the plane. Only one buffer can be queued per frame:
+// a previously queued buffer which hasn't been committed yet is released, see
+// swapchain_handle_commit.
+void swapchain_queue(struct swapchain *sc, struct framebuffer_dumb *fb) {
+	struct swapchain_buffer *buf = buffer_from_fb(sc, fb);
+	if (buf->state != SWAPCHAIN_BUFFER_ACQUIRED) {
+		fatal("queued swapchain buffer hasn't been acquired");
+	}
+
+	for (size_t i = 0; i < sc->buffers_len; ++i) {
+		if (sc->buffers[i].state == SWAPCHAIN_BUFFER_QUEUED) {
+			sc->buffers[i].state = SWAPCHAIN_BUFFER_FREE;
+		}
+	}
+
+	buf->state = SWAPCHAIN_BUFFER_QUEUED;
+	if (sc->plane != NULL) {
+		plane_set_framebuffer(sc->plane, &fb->fb);
+
+		if (!rect_empty(&sc->damage)) {
+			plane_add_damage(sc->plane, &sc->damage);
+		}
+	}
+
+	sc->damage_history[sc->damage_history_head] = sc->damage;
+	sc->damage_history_head =
+		(sc->damage_history_head + 1) % SWAPCHAIN_DAMAGE_HISTORY;
+	if (sc->damage_history_len < SWAPCHAIN_DAMAGE_HISTORY) {
+		++sc->damage_history_len;
+	}
+	sc->damage = (struct rect){ 0 };
+
+	for (size_t i = 0; i < sc->buffers_len; ++i) {
+		struct framebuffer_dumb *other = &sc->buffers[i].fb;
+		if (other->age > 0) {
+			++other->age;
+		}
+	}
+	fb->age = 1;
+}
+
+// Returns an acquired buffer without queuing it. The buffer's contents must not
+// have been changed.
+void swapchain_release(struct swapchain *sc, struct framebuffer_dumb *fb) {
+	struct swapchain_buffer *buf = buffer_from_fb(sc, fb);
+	if (buf->state != SWAPCHAIN_BUFFER_ACQUIRED) {
+		fatal("released swapchain buffer hasn't been acquired");
+	}
+	buf->state = SWAPCHAIN_BUFFER_FREE;
+}
+
+// Marks a region as changed in the frame being rendered
+void swapchain_add_damage(struct swapchain *sc, const struct rect *rect) {
+	rect_union(&sc->damage, rect);
+}
+
+// Computes the region of an acquired buffer which needs to be repainted: the
+// damage of the current frame plus the damage of all frames queued since the
+// buffer's contents were queued
+void swapchain_get_repaint(struct swapchain *sc, struct framebuffer_dumb *fb,
+		struct rect *repaint) {
+	if (fb->age == 0 || fb->age - 1 > sc->damage_history_len) {
+		*repaint = (struct rect){ 0, 0, fb->fb.width, fb->fb.height };
+		return;
+	}
+
+	*repaint = sc->damage;
+	for (size_t i = 0; i < fb->age - 1; ++i) {
+		size_t idx = (sc->damage_history_head + SWAPCHAIN_DAMAGE_HISTORY - 1 - i) %
+			SWAPCHAIN_DAMAGE_HISTORY;
+		rect_union(repaint, &sc->damage_history[idx]);
+	}
+}
+
+// Must be called once the commit including the queued buffer has been sent.
+// From then on, queuing another buffer doesn't release it.
+void swapchain_handle_commit(struct swapchain *sc) {
+	for (size_t i = 0; i < sc->buffers_len; ++i) {
+		if (sc->buffers[i].state == SWAPCHAIN_BUFFER_QUEUED) {
+			sc->buffers[i].state = SWAPCHAIN_BUFFER_COMMITTED;
+		}
+	}
+}
+
+// Releases a committed buffer which will never be displayed, e.g. because its
+// commit was replaced by a newer one before reaching the kernel
+void swapchain_handle_cancel(struct swapchain *sc, struct framebuffer_dumb *fb) {
+	struct swapchain_buffer *buf = buffer_from_fb(sc, fb);
+	if (buf->state != SWAPCHAIN_BUFFER_COMMITTED) {
+		fatal("cancelled swapchain buffer hasn't been committed");
+	}
+	buf->state = SWAPCHAIN_BUFFER_FREE;
+}
+
+// Must be called when the page-flip event for the commit including the queued
+// buffer is received. A buffer queued after the commit was sent stays queued.
+void swapchain_handle_page_flip(struct swapchain *sc) {
+	bool committed = false;
+	for (size_t i = 0; i < sc->buffers_len; ++i) {
+		if (sc->buffers[i].state == SWAPCHAIN_BUFFER_COMMITTED) {
+			committed = true;
+		}
+	}
+	if (!committed) {
+		// The previous buffer is still displayed
+		return;
+	}
+
+	for (size_t i = 0; i < sc->buffers_len; ++i) {
+		struct swapchain_buffer *buf = &sc->buffers[i];
+		switch (buf->state) {
+		case SWAPCHAIN_BUFFER_SCANOUT:
+			buf->state = SWAPCHAIN_BUFFER_FREE;
+			break;
+		case SWAPCHAIN_BUFFER_COMMITTED:
+			buf->state = SWAPCHAIN_BUFFER_SCANOUT;
+			break;
+		default:
+			break;
+		}
+	}
+}
@@ -0,0 +1,273 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "thread_pool.h"
+#include "util.h"
+
+#define CACHE_LINE_SIZE 64
+
+static void deque_init(struct thread_pool_deque *deque) {
+	pthread_mutex_init(&deque->mutex, NULL);
+}
+
+static void deque_finish(struct thread_pool_deque *deque) {
+	pthread_mutex_destroy(&deque->mutex);
+	free(deque->tasks);
+}
+
+static void deque_push_back(struct thread_pool_deque *deque,
+		const struct thread_pool_task *tasks, size_t tasks_len) {
+	pthread_mutex_lock(&deque->mutex);
+
+	if (deque->len + tasks_len > deque->cap) {
+		size_t cap = deque->cap > 0 ? deque->cap : 64;
+		while (cap < deque->len + tasks_len) {
+			cap *= 2;
+		}
+		// Unwrap the ring buffer into the new allocation
+		struct thread_pool_task *new_tasks = xalloc(cap * sizeof(*new_tasks));
+		for (size_t i = 0; i < deque->len; ++i) {
+			new_tasks[i] = deque->tasks[(deque->head + i) % deque->cap];
+		}
+		free(deque->tasks);
+		deque->tasks = new_tasks;
+		deque->head = 0;
+		deque->cap = cap;
+	}
+
+	for (size_t i = 0; i < tasks_len; ++i) {
+		deque->tasks[(deque->head + deque->len) % deque->cap] = tasks[i];
+		++deque->len;
+	}
+
+	pthread_mutex_unlock(&deque->mutex);
+}
+
+static bool deque_pop(struct thread_pool_deque *deque,
+		struct thread_pool_task *task, bool front) {
+	pthread_mutex_lock(&deque->mutex);
+
+	bool ok = deque->len > 0;
+	if (ok && front) {
+		*task = deque->tasks[deque->head];
+		deque->head = (deque->head + 1) % deque->cap;
+		--deque->len;
+	} else if (ok) {
+		--deque->len;
+		*task = deque->tasks[(deque->head + deque->len) % deque->cap];
+	}
+
+	pthread_mutex_unlock(&deque->mutex);
+	return ok;
+}
+
+static void complete_job(struct thread_pool *pool,
+		struct thread_pool_job *job) {
+	if (atomic_fetch_sub(&job->pending, 1) != 1) {
+		return;
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	pthread_cond_broadcast(&pool->done_cond);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+// Runs a task from the deque at index own, or steals one from another deque.
+// Returns false if there is no task left.
+static bool run_task(struct thread_pool *pool, size_t own) {
+	size_t deques_len = pool->workers_len + 1;
+
+	struct thread_pool_task task;
+	bool found = deque_pop(&pool->deques[own], &task, false);
+	for (size_t i = 1; !found && i < deques_len; ++i) {
+		found = deque_pop(&pool->deques[(own + i) % deques_len], &task, true);
+		if (found) {
+			atomic_fetch_add(&pool->steals, 1);
+		}
+	}
+	if (!found) {
+		return false;
+	}
+
+	atomic_fetch_sub(&pool->queued, 1);
+	task.job->func(task.job->data, &task.tile);
+	complete_job(pool, task.job);
+	return true;
+}
+
+static void *worker_run(void *data) {
+	struct thread_pool_worker *worker = data;
+	struct thread_pool *pool = worker->pool;
+
+	while (true) {
+		if (run_task(pool, worker->idx)) {
+			continue;
+		}
+
+		pthread_mutex_lock(&pool->mutex);
+		while (atomic_load(&pool->queued) == 0 && !pool->stop) {
+			pthread_cond_wait(&pool->work_cond, &pool->mutex);
+		}
+		bool stop = pool->stop && atomic_load(&pool->queued) == 0;
+		pthread_mutex_unlock(&pool->mutex);
+
+		if (stop) {
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+// threads includes the thread waiting for jobs, which runs tiles too. 0 picks
+// the number of online CPUs.
+void thread_pool_init(struct thread_pool *pool, size_t threads) {
+	if (threads == 0) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = n > 0 ? (size_t)n : 1;
+	}
+
+	// With a single thread, the caller runs all jobs and there are no workers.
+	// calloc may return NULL for a zero size, which xalloc treats as a failure.
+	pool->workers_len = threads - 1;
+	pool->workers = NULL;
+	if (pool->workers_len > 0) {
+		pool->workers = xalloc(pool->workers_len * sizeof(pool->workers[0]));
+	}
+	pool->deques = xalloc(threads * sizeof(pool->deques[0]));
+	atomic_init(&pool->next_deque, 0);
+	pool->stop = false;
+	atomic_init(&pool->queued, 0);
+	atomic_init(&pool->steals, 0);
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->work_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+
+	for (size_t i = 0; i < threads; ++i) {
+		deque_init(&pool->deques[i]);
+	}
+
+	for (size_t i = 0; i < pool->workers_len; ++i) {
+		struct thread_pool_worker *worker = &pool->workers[i];
+		worker->pool = pool;
+		worker->idx = i;
+		int ret = pthread_create(&worker->thread, NULL, worker_run, worker);
+		if (ret != 0) {
+			fatal("pthread_create failed: %d", ret);
+		}
+	}
+
+	printf("thread pool started with %zu workers\n", pool->workers_len);
+}
+
+// Pending jobs are run to completion
+void thread_pool_finish(struct thread_pool *pool) {
+	pthread_mutex_lock(&pool->mutex);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (size_t i = 0; i < pool->workers_len; ++i) {
+		pthread_join(pool->workers[i].thread, NULL);
+	}
+
+	printf("thread pool stopped, %"PRIu64" tasks stolen\n",
+		(uint64_t)atomic_load(&pool->steals));
+
+	for (size_t i = 0; i < pool->workers_len + 1; ++i) {
+		deque_finish(&pool->deques[i]);
+	}
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->work_cond);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool->deques);
+	free(pool->workers);
+}
+
+static size_t gcd(size_t a, size_t b) {
+	while (b != 0) {
+		size_t t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+// Returns the smallest number of rows, at least min_rows, such that tiles of
+// that height start on a cache line: tiles never share a cache line, even if
+// the stride isn't a multiple of the cache line size
+size_t thread_pool_tile_rows(uint32_t stride, uint32_t min_rows) {
+	size_t step = CACHE_LINE_SIZE / gcd(stride, CACHE_LINE_SIZE);
+	if (min_rows == 0) {
+		min_rows = 1;
+	}
+	return (min_rows + step - 1) / step * step;
+}
+
+// Splits rect into tiles and queues them. Tile boundaries are on multiples of
+// tile_rows, see thread_pool_tile_rows. Contiguous tiles are queued on the
+// same deque, so that workers walk memory linearly unless they need to steal.
+void thread_pool_submit(struct thread_pool *pool, struct thread_pool_job *job,
+		const struct rect *rect, uint32_t tile_rows) {
+	if (tile_rows == 0) {
+		tile_rows = 1;
+	}
+	uint32_t y1 = rect->y, y2 = rect->y + rect->height;
+	size_t first_tile = y1 / tile_rows;
+	size_t tiles_len = rect_empty(rect) ? 0 :
+		(y2 - 1) / tile_rows - first_tile + 1;
+
+	// Keep the job alive until all tiles are queued
+	atomic_init(&job->pending, tiles_len + 1);
+	atomic_fetch_add(&pool->queued, tiles_len);
+
+	size_t deques_len = pool->workers_len + 1;
+	size_t first_deque = atomic_fetch_add(&pool->next_deque, 1);
+	size_t chunk_len = (tiles_len + deques_len - 1) / deques_len;
+	struct thread_pool_task chunk[chunk_len + 1];
+	size_t tile = 0;
+	for (size_t i = 0; i < deques_len && tile < tiles_len; ++i) {
+		size_t n = 0;
+		for (; n < chunk_len && tile < tiles_len; ++n, ++tile) {
+			uint32_t tile_y1 = (first_tile + tile) * tile_rows;
+			uint32_t tile_y2 = tile_y1 + tile_rows;
+			if (tile_y1 < y1) {
+				tile_y1 = y1;
+			}
+			if (tile_y2 > y2) {
+				tile_y2 = y2;
+			}
+			chunk[n] = (struct thread_pool_task){
+				.job = job,
+				.tile = { rect->x, tile_y1, rect->width, tile_y2 - tile_y1 },
+			};
+		}
+
+		size_t deque_idx = (first_deque + i) % deques_len;
+		deque_push_back(&pool->deques[deque_idx], chunk, n);
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	complete_job(pool, job);
+}
+
+// Blocks until all tiles of the job are done, running queued tiles meanwhile
+void thread_pool_wait(struct thread_pool *pool, struct thread_pool_job *job) {
+	while (atomic_load(&job->pending) > 0) {
+		if (run_task(pool, pool->workers_len)) {
+			continue;
+		}
+
+		pthread_mutex_lock(&pool->mutex);
+		while (atomic_load(&job->pending) > 0 &&
+				atomic_load(&pool->queued) == 0) {
+			pthread_cond_wait(&pool->done_cond, &pool->mutex);
+		}
+		pthread_mutex_unlock(&pool->mutex);
+	}
+}
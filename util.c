@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdnoreturn.h>
+#include <time.h>
 
 noreturn void fatal(const char *fmt, ...) {
 	va_list args;
@@ -24,3 +25,18 @@ void *xalloc(size_t size) {
 
 	return ptr;
 }
+
+void *xrealloc(void *ptr, size_t size) {
+	ptr = realloc(ptr, size);
+	if (!ptr && size != 0) {
+		fatal_errno("Reallocation of size %zu failed", size);
+	}
+
+	return ptr;
+}
+
+uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}